@@ -37,8 +37,10 @@ void Graph::draw()
             fl_color(0);
         else if (x == 1)
             fl_color(14);
-        else
+        else if (x == 2)
             fl_color(11);
+        else
+            fl_color(FL_RED);
         fl_begin_line();
         for (int i = 0; i < vals.size(); ++i)
         {
@@ -2,6 +2,7 @@
 //#define VEC_ENABLE_CHECKS
 
 #include "ai_play.h"
+#include "autotune.h"
 #include "game.h"
 #include "graph.h"
 #include "kv_range.h"
@@ -9,7 +10,6 @@
 #include "margins.h"
 #include "model.h"
 #include "modeldims.h"
-#include "rjwriter.h"
 #include "thunks.h"
 #include "vec.h"
 #include "worker.h"
@@ -32,6 +32,7 @@
 #include <FL/Fl_Select_Browser.H>
 #include <FL/Fl_Valuator.H>
 #include <FL/Fl_Widget.H>
+#include <FL/fl_ask.H>
 #include <FL/fl_draw.H>
 #include <algorithm>
 #include <atomic>
@@ -171,6 +172,7 @@ struct MLStats_Group : Fl_Group
             m_compete.m_graph.valss[0].clear();
             m_compete.m_graph.valss[1].clear();
             m_compete.m_graph.valss[2].clear();
+            m_compete.m_graph.valss[3].clear();
             float last_v[4] = {};
             for (auto&& [k, v] : kv_range(s_workers[0]->m_compete_results))
             {
@@ -182,6 +184,11 @@ struct MLStats_Group : Fl_Group
                 if (k > 0) m_compete.m_graph.valss[1].push_back((last_v[0] + last_v[1]) / 2);
                 if (k > 2) m_compete.m_graph.valss[2].push_back((last_v[0] + last_v[1] + last_v[2] + last_v[3]) / 4);
             }
+            // While distilling, the baseline is the teacher; also show how often the student picks its action.
+            if (s_workers[0]->m_distilling)
+                std::copy(std::begin(s_workers[0]->m_agreement),
+                          std::end(s_workers[0]->m_agreement),
+                          std::back_inserter(m_compete.m_graph.valss[3]));
             m_compete.m_graph.damage(FL_DAMAGE_ALL);
             m_compete.m_graph.redraw();
 
@@ -197,7 +204,7 @@ struct MLStats_Group : Fl_Group
             , m_graph(x, y + 20, w, h - 20, "Compete")
         {
             m_choice.m.callback(thunkv<Compete, &Compete::cb_OnChoice>, this);
-            m_graph.valss.resize(3);
+            m_graph.valss.resize(4);
             m_graph.max_y = 1.0f;
             this->resizable(m_graph);
             this->end();
@@ -311,19 +318,25 @@ struct Model_Explorer : Fl_Double_Window
     {
         int v = m_sweep.m.value();
         if (v == -1) return;
-        Encoded e = m_encoded;
-        auto eval = m_model->make_eval();
+        std::vector<Encoded> es(11, m_encoded);
+        std::vector<std::unique_ptr<IEval>> evals;
+        std::vector<IEval*> eval_ptrs;
+        for (size_t x = 0; x < es.size(); ++x)
+        {
+            es[x].data[v] = x * 0.1f;
+            evals.push_back(m_model->make_eval());
+            eval_ptrs.push_back(evals.back().get());
+        }
+        m_model->calc_batch(es, eval_ptrs, false);
+
         for (auto&& g : m_graphs)
         {
             g->valss.resize(2);
             g->valss[0].resize(0);
             g->valss[1].resize(0);
         }
-        for (int x = 0; x < 11; ++x)
+        for (auto&& eval : evals)
         {
-            e.data[v] = x * 0.1f;
-            m_model->calc(*eval, e, false);
-
             double min_val = eval->out().min(1.0f);
             for (int i = 0; i < eval->out().size() && i < m_graphs.size(); ++i)
             {
@@ -366,9 +379,9 @@ struct Game_Group : Fl_Group
         m_new_game.callback([](Fl_Widget* w, void*) {
             auto& self = *(Game_Group*)w->parent();
             if (0 > self.m_ai_choice.value() || self.m_ai_choice.value() >= s_models_list.models.size())
-                self.cur_model = s_workers[0]->clone_model();
+                self.cur_model = s_workers[0]->freeze_model();
             else
-                self.cur_model = s_models_list.models[self.m_ai_choice.value()]->clone();
+                self.cur_model = s_models_list.models[self.m_ai_choice.value()];
 
             self.g.init();
             self.turns.clear();
@@ -388,8 +401,7 @@ struct Game_Group : Fl_Group
         turn.player2_turn = g.player2_turn;
         turn.eval = cur_model->make_eval();
         turn.eval_full = cur_model->make_eval();
-        cur_model->calc(*turn.eval, turn.input, false);
-        cur_model->calc(*turn.eval_full, turn.input, true);
+        cur_model->calc_both(*turn.eval, *turn.eval_full, turn.input);
         m_gamelog.add(("@." + g.format()).c_str());
         m_turn_viewer.m_actions.child().clear();
         auto actions = g.format_actions();
@@ -467,7 +479,7 @@ std::unique_ptr<IModel> open_model()
     HRESULT hr;
 
     COMDLG_FILTERSPEC rgSpec[] = {
-        {L"JSON Files", L"*.json"},
+        {L"Model Files", L"*.json;*.mlcm"},
         {L"All Files", L"*.*"},
     };
 
@@ -488,13 +500,9 @@ std::unique_ptr<IModel> open_model()
     std::wstring p(pszPath);
     CoTaskMemFree(pszPath);
 
-    std::stringstream ss;
-    std::ifstream is(p);
-    is.get(*ss.rdbuf());
-
     try
     {
-        return load_model(ss.str());
+        return load_model_file(p);
     }
     catch (const std::exception& e)
     {
@@ -517,6 +525,7 @@ void save_model(IModel& model)
 
     COMDLG_FILTERSPEC rgSpec[] = {
         {L"JSON Files", L"*.json"},
+        {L"Binary Model Files", L"*.mlcm"},
         {L"All Files", L"*.*"},
     };
 
@@ -544,22 +553,37 @@ void save_model(IModel& model)
     {
         path += L".json";
     }
+    if (i == 2 && (path.size() < 6 || path.substr(path.size() - 5) != L".mlcm"))
+    {
+        path += L".mlcm";
+    }
     CoTaskMemFree(pszPath);
 
+    // Write beside the target and rename over it: the target may be the .mlcm file a loaded model is still reading
+    // its parameters from, which must not be truncated under it.
+    const std::filesystem::path target = path;
+    auto tmp = target;
+    tmp += L".tmp";
     try
     {
-        StringBuffer s;
-        RJWriter wr(s);
-        model.serialize(wr);
-
-        std::ofstream os(path);
-        os.write(s.GetString(), s.GetSize());
+        {
+            std::ofstream os(tmp, i == 2 ? std::ios::out | std::ios::binary : std::ios::out);
+            if (i == 2)
+                model.serialize_binary(os);
+            else
+                save_model(model, os);
+            os.close();
+            if (!os) throw std::runtime_error("could not write the file");
+        }
+        std::filesystem::rename(tmp, target);
         fmt::print(L"Wrote {}\n", path);
     }
     catch (std::exception& e)
     {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
         fmt::print(L"Failed to write {}: ", path);
-        fmt::print("{}", e.what());
+        fmt::print("{}\n", e.what());
     }
 #endif
 }
@@ -665,15 +689,16 @@ struct Manager_Window : Fl_Double_Window
     {
         Workers_Browser(int x, int y, int w, int h, const char* label = 0)
             : Fl_Group(x, y, w, h, label)
-            , m_freeze(x, y, w / 2, 26, "Freeze")
-            , m_thaw(x + w / 2, y, w / 2, 26, "Thaw")
+            , m_freeze(x, y, w / 3, 26, "Freeze")
+            , m_thaw(x + w / 3, y, w / 3, 26, "Thaw")
+            , m_distill(x + 2 * w / 3, y, w - 2 * w / 3, 26, "Distill")
             , m_browser(x, y + 26, w, h - 26 - 15, "Workers")
         {
             this->resizable(m_browser);
             this->end();
         }
 
-        Fl_Button m_freeze, m_thaw;
+        Fl_Button m_freeze, m_thaw, m_distill;
         Fl_Hold_Browser m_browser;
     };
     struct Tournament_Browser : Fl_Group
@@ -736,6 +761,30 @@ struct Manager_Window : Fl_Double_Window
         s_workers[w_line - 1]->replace_model(m->clone());
         m_workers.child().m_browser.text(w_line, m->name().c_str());
     }
+    // Restarts the selected worker from a fresh small_model_dims() model, taught by the selected model. With no model
+    // selected the worker goes back to self-play, keeping its student, and competes against the chosen baseline again.
+    void cb_Distill()
+    {
+        int w_line = m_workers.child().m_browser.value();
+        if (w_line == 0 || m_workers.child().m_browser.size() != s_workers.size()) return;
+        auto& w = *s_workers[w_line - 1];
+
+        auto& b = m_models.child();
+        int b_line = b.value();
+        if (b_line == 0)
+        {
+            w.set_teacher(nullptr);
+            return;
+        }
+
+        if (b.size() != s_models_list.models.size()) return;
+        auto&& m = s_models_list.models[b_line - 1];
+
+        auto student = make_model(small_model_dims(), "d" + m->root_name());
+        m_workers.child().m_browser.text(w_line, student->name().c_str());
+        w.replace_model(std::move(student));
+        w.set_teacher(m);
+    }
     void cb_New() { }
     void cb_Open()
     {
@@ -752,6 +801,16 @@ struct Manager_Window : Fl_Double_Window
         if (b.size() != s_models_list.models.size()) return;
         save_model(*s_models_list.models[b_line - 1]);
     }
+    void cb_Sparsity()
+    {
+        auto& b = m_models.child();
+        int b_line = b.value();
+        if (b_line == 0) return;
+
+        if (b.size() != s_models_list.models.size()) return;
+        auto& m = *s_models_list.models[b_line - 1];
+        fl_message("%s\n\n%s", m.name().c_str(), m.sparsity_report().c_str());
+    }
     void cb_Rename()
     {
         if (m_modal_rename.visible())
@@ -824,6 +883,7 @@ struct Manager_Window : Fl_Double_Window
         m_modal_rename.on_submit(thunkv<Manager_Window, &Manager_Window::cb_Rename_Ok>, this);
         m_workers.child().m_freeze.callback((Fl_Callback*)::thunkv<Manager_Window, &Manager_Window::cb_Freeze>, this);
         m_workers.child().m_thaw.callback((Fl_Callback*)::thunkv<Manager_Window, &Manager_Window::cb_Thaw>, this);
+        m_workers.child().m_distill.callback((Fl_Callback*)::thunkv<Manager_Window, &Manager_Window::cb_Distill>, this);
         m_tourny.child().m_tfreeze.callback((Fl_Callback*)::thunkv<Manager_Window, &Manager_Window::cb_TFreeze>, this);
         m_tourny.child().m_remove.callback((Fl_Callback*)::thunkv<Manager_Window, &Manager_Window::cb_TRemove>, this);
         this->callback([](Fl_Widget* p, void*) { std::exit(0); });
@@ -852,6 +912,7 @@ struct Manager_Window : Fl_Double_Window
         {"&Save", 0x40073, thunk1<MW, &MW::cb_Save>, 0, 0, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
         {"&Rename", 0xffbf, thunk1<MW, &MW::cb_Rename>, 0, 0, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
         {"&Delete", 0xffff, thunk1<MW, &MW::cb_Delete>, 0, 0, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
+        {"S&parsity Report", 0, thunk1<MW, &MW::cb_Sparsity>, 0, 0, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
         {0, 0, 0, 0, 0, 0, 0, 0, 0},
         {"&Windows", 0, 0, 0, 64, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
         {"&Play", 0, thunk1<MW, &MW::cb_show_play>, 0, 0, (uchar)FL_NORMAL_LABEL, 0, 14, 0},
@@ -1056,7 +1117,7 @@ struct Tournament_Group : Fl_Group
                 for (size_t i = local_data.size(); i < new_size; ++i)
                     local_data.emplace_back(new_size);
                 for (auto&& w : s_workers)
-                    local_models.push_back(w->clone_model());
+                    local_models.push_back(w->freeze_model());
             }
         }
 
@@ -1182,6 +1243,7 @@ static void on_timeout(void* v)
 int main(int argc, char* argv[])
 {
     srand((unsigned int)time(NULL));
+    layer_autotuner::set_cache_file(layer_autotuner::default_cache_file());
     s_workers.push_back(std::make_unique<Worker>());
     s_workers.push_back(std::make_unique<Worker>());
     s_workers.push_back(std::make_unique<Worker>());
@@ -17,9 +17,10 @@ struct APIGame
     rapidjson::StringBuffer s;
 };
 
+// Only ever evaluated, so one APIModel may serve ai_take_action on any number of threads at once.
 struct APIModel
 {
-    std::shared_ptr<IModel> m;
+    std::shared_ptr<const IModel> m;
 };
 
 API APIGame* alloc_game()
@@ -33,7 +34,21 @@ API APIModel* alloc_model(const char* json)
     try
     {
         auto r = std::make_unique<APIModel>();
-        r->m = load_model(json);
+        r->m = load_model(json, true);
+        return r.release();
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+// path may name a JSON or a binary model file; binary files are mapped and shared between processes.
+API APIModel* alloc_model_file(const char* path)
+{
+    try
+    {
+        auto r = std::make_unique<APIModel>();
+        r->m = load_model_file(std::filesystem::u8path(path), true);
         return r.release();
     }
     catch (...)
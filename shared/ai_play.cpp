@@ -1,43 +1,83 @@
 #include "ai_play.h"
+#include <algorithm>
 
-std::pair<int, int> run_n(IModel& m1, IModel& m2, size_t n)
+std::pair<int, int> run_n(const IModel& m1, const IModel& m2, size_t n)
 {
-    Game g;
-    std::vector<Turn> turns;
+    // Play several games side by side so each model evaluates every game waiting on it with one calc_batch.
+    const size_t width = std::min<size_t>(n, 16);
+    const IModel* models[2] = {&m1, &m2};
+    std::vector<Encoded> inputs[2];
+    std::vector<std::unique_ptr<IEval>> evals[2];
+    std::vector<IEval*> eval_ptrs[2];
+    std::vector<Game*> waiting[2];
+    for (int p = 0; p < 2; ++p)
+    {
+        inputs[p].resize(width);
+        for (size_t i = 0; i < width; ++i)
+        {
+            evals[p].push_back(models[p]->make_eval());
+            eval_ptrs[p].push_back(evals[p].back().get());
+        }
+    }
+
+    std::vector<Game> games(width);
+    std::vector<Game*> active;
+    for (auto& g : games)
+    {
+        g.init();
+        active.push_back(&g);
+    }
+    size_t started = width;
     int p1_wins = 0;
     int p2_wins = 0;
 
-    for (int x = 0; x < n; ++x)
+    while (!active.empty())
     {
-        g.init();
-        turns.clear();
-        turns.reserve(40);
+        waiting[0].clear();
+        waiting[1].clear();
+        for (auto g : active)
+        {
+            auto& w = waiting[g->player2_turn];
+            g->encode(inputs[g->player2_turn][w.size()]);
+            w.push_back(g);
+        }
+        for (int p = 0; p < 2; ++p)
+        {
+            auto k = waiting[p].size();
+            if (k == 0) continue;
+            models[p]->calc_batch({inputs[p].data(), k}, {eval_ptrs[p].data(), k}, false);
 
-        while (g.cur_result() == Game::Result::playing)
+            // choose action to take
+            for (size_t i = 0; i < k; ++i)
+                waiting[p][i]->advance(eval_ptrs[p][i]->best_action());
+        }
+
+        for (size_t i = 0; i < active.size();)
         {
-            turns.emplace_back();
-            auto& turn = turns.back();
-            turn.input = g.encode();
-            if (g.player2_turn)
+            auto g = active[i];
+            auto result = g->cur_result();
+            if (result == Game::Result::playing)
+            {
+                ++i;
+                continue;
+            }
+            if (result == Game::Result::p1_win)
+                ++p1_wins;
+            else if (result == Game::Result::p2_win)
+                ++p2_wins;
+
+            if (started < n)
             {
-                turn.eval = m2.make_eval();
-                m2.calc(*turn.eval, turn.input, false);
+                ++started;
+                g->init();
+                ++i;
             }
             else
             {
-                turn.eval = m1.make_eval();
-                m1.calc(*turn.eval, turn.input, false);
+                active[i] = active.back();
+                active.pop_back();
             }
-
-            // choose action to take
-            turn.take_ai_action();
-
-            g.advance(turn.chosen_action);
         }
-        if (g.cur_result() == Game::Result::p1_win)
-            ++p1_wins;
-        else if (g.cur_result() == Game::Result::p2_win)
-            ++p2_wins;
     }
     return {p1_wins, p2_wins};
 }
@@ -20,4 +20,4 @@ struct Turn
     void take_full_ai_action() { chosen_action = eval_full->best_action(); }
 };
 
-std::pair<int, int> run_n(IModel& m1, IModel& m2, size_t n);
+std::pair<int, int> run_n(const IModel& m1, const IModel& m2, size_t n);
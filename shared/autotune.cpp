@@ -0,0 +1,226 @@
+#include "autotune.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+const char* kernel_name(LayerKernel k)
+{
+    switch (k)
+    {
+        case LayerKernel::dot: return "dot";
+        case LayerKernel::axpy: return "axpy";
+        default: return "unknown";
+    }
+}
+
+static LayerKernel kernel_from_name(const std::string& s)
+{
+    for (int i = 0; i < (int)LayerKernel::Count; ++i)
+        if (s == kernel_name((LayerKernel)i)) return (LayerKernel)i;
+    return LayerKernel::Count;
+}
+
+std::string layer_autotuner::cpu_model()
+{
+    unsigned int regs[12] = {};
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0x80000000);
+    if ((unsigned int)info[0] < 0x80000004) return "unknown";
+    for (int i = 0; i < 3; ++i)
+        __cpuid((int*)regs + 4 * i, 0x80000002 + i);
+#elif defined(__i386__) || defined(__x86_64__)
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000004) return "unknown";
+    for (unsigned int i = 0; i < 3; ++i)
+        __get_cpuid(0x80000002 + i, &regs[4 * i], &regs[4 * i + 1], &regs[4 * i + 2], &regs[4 * i + 3]);
+#else
+    return "unknown";
+#endif
+    std::string s(reinterpret_cast<const char*>(regs), sizeof(regs));
+    s.resize(s.find_last_not_of(std::string(" \0", 2)) + 1);
+    s.erase(0, s.find_first_not_of(' '));
+    return s;
+}
+
+static std::mutex s_mutex;
+static std::map<std::pair<int, int>, LayerKernel> s_choices;
+static std::filesystem::path s_cache_file;
+
+// Best-of-three wall time for `reps` forward passes of one kernel.
+static double time_kernel(LayerKernel k, mat_slice coefs, vec_slice input, vec_slice out, int reps)
+{
+    double best = 1e30;
+    for (int trial = 0; trial < 3; ++trial)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            layer_forward(k, coefs, input, out, 0, out.size());
+            // Feed the output back so the passes cannot be folded together.
+            if (input.size()) input[r % input.size()] += out[0] * 1e-30f;
+        }
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+static LayerKernel benchmark(int input, int output)
+{
+    vec coefs, in, out;
+    coefs.realloc_uninitialized((size_t)input * output);
+    in.realloc_uninitialized(input - 1);
+    out.realloc_uninitialized(output);
+    for (size_t i = 0; i < coefs.size(); ++i)
+        coefs[i] = (float)((i * 7919) % 201) / 100.0f - 1.0f;
+    for (size_t i = 0; i < in.size(); ++i)
+        in[i] = (float)((i * 104729) % 101) / 100.0f;
+
+    // Roughly a million multiply-adds per trial.
+    const int reps = std::max(1, (1 << 20) / (input * output));
+    auto best = LayerKernel::dot;
+    double best_time = 1e30;
+    for (int i = 0; i < (int)LayerKernel::Count; ++i)
+    {
+        auto t = time_kernel((LayerKernel)i, mat_slice(coefs.data(), input, output), in, out, reps);
+        if (t < best_time)
+        {
+            best_time = t;
+            best = (LayerKernel)i;
+        }
+    }
+    return best;
+}
+
+static std::string get_env(const char* name)
+{
+#if defined(_MSC_VER)
+    char* v = nullptr;
+    size_t n = 0;
+    if (_dupenv_s(&v, &n, name) || !v) return {};
+    std::string s(v);
+    free(v);
+    return s;
+#else
+    const char* v = std::getenv(name);
+    return v ? v : "";
+#endif
+}
+
+std::filesystem::path layer_autotuner::default_cache_file()
+{
+    std::filesystem::path dir;
+#if defined(_WIN32)
+    auto base = get_env("LOCALAPPDATA");
+    if (base.empty()) return {};
+    dir = std::filesystem::u8path(base);
+#else
+    if (auto xdg = get_env("XDG_CACHE_HOME"); !xdg.empty())
+        dir = xdg;
+    else if (auto home = get_env("HOME"); !home.empty())
+        dir = std::filesystem::path(home) / ".cache";
+    else
+        return {};
+#endif
+    dir /= "mlcard";
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) return {};
+    return dir / "kernels.txt";
+}
+
+// One choice per line: <cpu model>|<input>|<output>|<kernel>
+using cache_key = std::tuple<std::string, int, int>;
+
+static std::map<cache_key, LayerKernel> read_cache(const std::filesystem::path& path)
+{
+    std::map<cache_key, LayerKernel> entries;
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream ls(line);
+        std::string model, in, out, kernel;
+        if (!std::getline(ls, model, '|') || !std::getline(ls, in, '|') || !std::getline(ls, out, '|') ||
+            !std::getline(ls, kernel))
+            continue;
+        auto k = kernel_from_name(kernel);
+        if (k == LayerKernel::Count) continue;
+        entries[{model, std::atoi(in.c_str()), std::atoi(out.c_str())}] = k;
+    }
+    return entries;
+}
+
+// Rewrite the cache file with this CPU's choices merged over whatever it already holds, so entries stay unique and
+// other machines' lines are kept. Called with s_mutex held.
+static void save_cache()
+{
+    auto entries = read_cache(s_cache_file);
+    const auto cpu = layer_autotuner::cpu_model();
+    for (const auto& [shape, k] : s_choices)
+        entries[{cpu, shape.first, shape.second}] = k;
+
+    auto tmp = s_cache_file;
+    tmp += ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        for (const auto& [key, k] : entries)
+        {
+            const auto& [model, in, out] = key;
+            f << model << '|' << in << '|' << out << '|' << kernel_name(k) << '\n';
+        }
+        if (!f) return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, s_cache_file, ec);
+}
+
+void layer_autotuner::set_cache_file(std::filesystem::path path)
+{
+    std::lock_guard<std::mutex> lk(s_mutex);
+    s_cache_file = std::move(path);
+
+    const auto cpu = cpu_model();
+    for (const auto& [key, k] : read_cache(s_cache_file))
+        if (std::get<0>(key) == cpu) s_choices[{std::get<1>(key), std::get<2>(key)}] = k;
+}
+
+LayerKernel layer_autotuner::choose(int input, int output)
+{
+    if (input <= 0 || output <= 0) return LayerKernel::dot;
+
+    {
+        std::lock_guard<std::mutex> lk(s_mutex);
+        auto it = s_choices.find({input, output});
+        if (it != s_choices.end()) return it->second;
+    }
+
+    // Benchmark unlocked so other shapes and cached lookups are not held up; if another thread finished the same
+    // shape first, its choice wins so every layer of that shape agrees.
+    auto k = benchmark(input, output);
+    std::lock_guard<std::mutex> lk(s_mutex);
+    auto [it, inserted] = s_choices.emplace(std::make_pair(input, output), k);
+    if (!inserted) return it->second;
+    if (!s_cache_file.empty()) save_cache();
+    return k;
+}
+
+LayerKernel layer_autotuner::known(int input, int output)
+{
+    if (input <= 0 || output <= 0) return LayerKernel::dot;
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    auto it = s_choices.find({input, output});
+    return it != s_choices.end() ? it->second : LayerKernel::Count;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "vec.h"
+#include <atomic>
+#include <filesystem>
+#include <string>
+
+/// <summary>
+/// Dense forward kernels for Layer. All of them accumulate each output in the same order, so the choice only affects
+/// speed, never results.
+/// </summary>
+enum class LayerKernel : unsigned char
+{
+    // out[i] = column i of the coefficients dot (input... 1); strided reads.
+    dot,
+    // out = (input... 1) * coefficients, four contiguous rows at a time.
+    axpy,
+    Count,
+};
+
+const char* kernel_name(LayerKernel k);
+
+/// <summary>
+/// Compute out[i] for i in [begin, end) of the layer (input... 1) * coefs.
+/// </summary>
+inline void layer_forward(LayerKernel k, mat_slice coefs, cvec_slice input, vec_slice out, size_t begin, size_t end)
+{
+    switch (k)
+    {
+        case LayerKernel::axpy: out.slice(begin, end - begin).assign_vm1_mult(coefs, input, begin); break;
+        default:
+            for (size_t i = begin; i < end; ++i)
+                out[i] = coefs.col(i).dot1(input);
+            break;
+    }
+}
+
+/// <summary>
+/// Picks the fastest LayerKernel for each layer shape by microbenchmarking the candidates the first time the shape is
+/// seen. Choices are remembered for the process and, once a cache file is set, persisted there keyed by CPU model so
+/// later runs on the same machine skip the benchmark.
+/// </summary>
+struct layer_autotuner
+{
+    /// <summary>
+    /// Load previous choices for this CPU from path, and rewrite it with the merged choices whenever a new shape is
+    /// benchmarked.
+    /// </summary>
+    static void set_cache_file(std::filesystem::path path);
+
+    /// <summary>
+    /// Per-user location for the cache file (under %LOCALAPPDATA% on Windows, the XDG cache directory elsewhere),
+    /// creating its directory if needed. Empty if there is no such location.
+    /// </summary>
+    static std::filesystem::path default_cache_file();
+
+    /// <summary>
+    /// Kernel to use for a layer with `input` rows (including the bias row) and `output` columns. Benchmarks the
+    /// shape if it has not been seen before.
+    /// </summary>
+    static LayerKernel choose(int input, int output);
+
+    /// <summary>
+    /// The kernel already chosen for this shape, or LayerKernel::Count if it has not been benchmarked yet.
+    /// </summary>
+    static LayerKernel known(int input, int output);
+
+    static std::string cpu_model();
+};
+
+/// <summary>
+/// A layer's kernel, resolved through layer_autotuner the first time the layer runs a dense forward pass, so creating
+/// or loading a model never waits on a benchmark and layers that never use a dense kernel are never benchmarked.
+/// Threads racing to resolve it all store the same choice.
+/// </summary>
+struct layer_kernel_slot
+{
+    layer_kernel_slot() = default;
+    layer_kernel_slot(const layer_kernel_slot& o) : m_k(o.m_k.load(std::memory_order_relaxed)) {}
+    layer_kernel_slot& operator=(const layer_kernel_slot& o)
+    {
+        m_k.store(o.m_k.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    LayerKernel get(int input, int output) const
+    {
+        auto k = m_k.load(std::memory_order_relaxed);
+        if (k == LayerKernel::Count)
+        {
+            k = layer_autotuner::choose(input, output);
+            m_k.store(k, std::memory_order_relaxed);
+        }
+        return k;
+    }
+
+    void reset() { m_k.store(LayerKernel::Count, std::memory_order_relaxed); }
+
+private:
+    mutable std::atomic<LayerKernel> m_k{LayerKernel::Count};
+};
@@ -0,0 +1,69 @@
+#include "fixed_layer.h"
+
+struct fixed_shape
+{
+    int input;
+    int output;
+    fixed_layer_fn fn;
+};
+
+template<int In, int Out>
+constexpr fixed_shape shape()
+{
+    return {In + 1, Out, &FixedLayer<In, Out>::calc};
+}
+
+// Inputs are counted without the bias row here. Board input is 22 wide and a card 11; the first layer of each card
+// input model is sparse and so not listed.
+static constexpr fixed_shape s_shapes[] = {
+    // Board model, default and medium.
+    shape<22, 30>(),
+    shape<30, 30>(),
+    // Card input models, default and medium.
+    shape<20, 20>(),
+    // l and card output, default.
+    shape<51, 40>(),
+    shape<40, 40>(),
+    shape<40, 30>(),
+    shape<50, 30>(),
+    shape<30, 20>(),
+    // l and card output, medium.
+    shape<51, 30>(),
+    shape<50, 20>(),
+    // ReLUCascade l of the bin/main workers clC432/4/1 (40/10), lC40/20 and lC48/30: a layer of 4 per step, each
+    // step's input 4 wider than the last, then the output layer.
+    shape<51, 4>(),
+    shape<55, 4>(),
+    shape<59, 4>(),
+    shape<63, 4>(),
+    shape<67, 4>(),
+    shape<71, 4>(),
+    shape<75, 4>(),
+    shape<79, 4>(),
+    shape<83, 4>(),
+    shape<87, 4>(),
+    shape<91, 4>(),
+    shape<95, 4>(),
+    shape<91, 10>(),
+    shape<91, 20>(),
+    shape<99, 30>(),
+    // Card output {40, 30, 20} of clC432/4/1.
+    shape<30, 40>(),
+    // Final win chance layers.
+    shape<30, 1>(),
+    shape<20, 1>(),
+    shape<10, 1>(),
+    // small_model_dims.
+    shape<22, 6>(),
+    shape<6, 6>(),
+    shape<13, 6>(),
+    shape<12, 6>(),
+    shape<6, 1>(),
+};
+
+fixed_layer_fn find_fixed_layer(int input, int output)
+{
+    for (auto& s : s_shapes)
+        if (s.input == input && s.output == output) return s.fn;
+    return nullptr;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+
+/// <summary>
+/// Forward pass of a dense layer whose shape is fixed at compile time: out = (input... 1) * coefs, then the first
+/// min(In, Out) inputs added back on, as Layer::calc does. With every bound constexpr the loops unroll and the
+/// accumulators stay in registers or on the stack. Outputs accumulate in the same order as the LayerKernel loops, so
+/// results match the dynamic path exactly.
+/// </summary>
+template<int In, int Out>
+struct FixedLayer
+{
+    // coefs is float[In + 1][Out], bias row last.
+    static void calc(const float* coefs, const float* input, float* out)
+    {
+        float acc[Out];
+        for (int j = 0; j < Out; ++j)
+            acc[j] = coefs[In * Out + j];
+        for (int i = 0; i < In; ++i)
+        {
+            const float x = input[i];
+            const float* row = coefs + i * Out;
+            for (int j = 0; j < Out; ++j)
+                acc[j] += row[j] * x;
+        }
+        constexpr int min_io = std::min(In, Out);
+        for (int j = 0; j < min_io; ++j)
+            out[j] = acc[j] + input[j];
+        for (int j = min_io; j < Out; ++j)
+            out[j] = acc[j];
+    }
+};
+
+using fixed_layer_fn = void (*)(const float* coefs, const float* input, float* out);
+
+/// <summary>
+/// The compiled FixedLayer for a layer with `input` rows (including the bias row) and `output` columns, or null when
+/// that shape has no specialization. The compiled shapes are those of the dense layers in default_model_dims,
+/// medium_model_dims and small_model_dims, and of the cascade models bin/main trains alongside them.
+/// </summary>
+fixed_layer_fn find_fixed_layer(int input, int output);
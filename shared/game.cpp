@@ -1,6 +1,7 @@
 #include "game.h"
 #include "kv_range.h"
 #include "rjwriter.h"
+#include <cmath>
 #include <cstdlib>
 #include <fmt/format.h>
 #include <rapidjson/document.h>
@@ -36,6 +37,63 @@ void Card::encode(vec_slice x) const
         c.artifact_slice()[(int)artifact] = 1;
     }
 }
+int Card::encoding_index(cvec_slice x)
+{
+    auto artifacts = x.slice((int)Type::Count);
+    Card card;
+    card.type = Type::Count;
+    for (int t = 0; t < (int)Type::Count; ++t)
+    {
+        if (x[t] != 0.0f)
+        {
+            card.type = (Type)t;
+            break;
+        }
+    }
+    int i;
+    if (card.type == Type::Count)
+    {
+        return -1;
+    }
+    else if (card.type == Type::Artifact)
+    {
+        int a = 0;
+        while (a < (int)ArtifactType::Count && artifacts[a] == 0.0f)
+            ++a;
+        if (a == (int)ArtifactType::Count) return -1;
+        card.artifact = (ArtifactType)a;
+        i = (int)Type::Artifact * max_value + a;
+    }
+    else
+    {
+        card.value = (int)std::lround(x[(int)card.type] * 10.0f);
+        if (card.value < 1 || card.value > max_value) return -1;
+        i = (int)card.type * max_value + card.value - 1;
+    }
+
+    float canonical[encoded_size];
+    card.encode(canonical);
+    for (size_t j = 0; j < encoded_size; ++j)
+    {
+        if (canonical[j] != x[j]) return -1;
+    }
+    return i;
+}
+Card Card::from_encoding_index(int i)
+{
+    Card card;
+    if (i >= (int)Type::Artifact * max_value)
+    {
+        card.type = Type::Artifact;
+        card.artifact = (ArtifactType)(i - (int)Type::Artifact * max_value);
+    }
+    else
+    {
+        card.type = (Type)(i / max_value);
+        card.value = i % max_value + 1;
+    }
+    return card;
+}
 static const char* card_encoded_desc(int i)
 {
     if (i < (int)Card::Type::Count) return card_name((Card::Type)i);
@@ -64,7 +122,10 @@ void Player::encode_cards(vec_slice x) const
 }
 void Player::init(bool p1)
 {
+    // Keep the hand's storage across games.
+    auto cards = std::move(avail);
     *this = Player();
+    avail = std::move(cards);
     avail.clear();
     avail.resize(p1 ? 6 : 7);
     for (auto&& c : avail)
@@ -90,12 +151,12 @@ std::vector<std::string> Game::input_descs()
         ret.push_back(fmt::format("you_have_{}", artifact_name((ArtifactType)i)));
     auto& me = player2_turn ? p2 : p1;
     auto& you = player2_turn ? p1 : p2;
-    for (int i = 0; i < me.avail.size(); ++i)
-        for (int j = 0; j < Card::encoded_size; ++j)
+    for (int i = 0; i < (int)me.avail.size(); ++i)
+        for (int j = 0; j < (int)Card::encoded_size; ++j)
             ret.push_back(fmt::format("me_card{}_{}", i, card_encoded_desc(j)));
 
-    for (int i = 0; i < you.avail.size(); ++i)
-        for (int j = 0; j < Card::encoded_size; ++j)
+    for (int i = 0; i < (int)you.avail.size(); ++i)
+        for (int j = 0; j < (int)Card::encoded_size; ++j)
             ret.push_back(fmt::format("you_card{}_{}", i, card_encoded_desc(j)));
 
     return ret;
@@ -104,6 +165,12 @@ std::vector<std::string> Game::input_descs()
 Encoded Game::encode() const
 {
     Encoded e;
+    encode(e);
+    return e;
+}
+
+void Game::encode(Encoded& e) const
+{
     e.data.realloc_uninitialized(Encoded::board_size + Encoded::card_size * (p1.cards() + p2.cards()));
     e.data[0] = turn / 30.0f;
     e.data[1] = player2_turn;
@@ -131,8 +198,6 @@ Encoded Game::encode() const
         p1.encode_cards(e.me_cards_in());
         p2.encode_cards(e.you_cards_in());
     }
-    Encoded e2 = static_cast<Encoded&&>(e);
-    return std::move(e);
 }
 
 void Game::init()
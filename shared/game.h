@@ -43,6 +43,16 @@ struct Card
     void encode(vec_slice x) const;
 
     static constexpr size_t encoded_size = (size_t)Type::Count + (size_t)ArtifactType::Count;
+
+    // Every encode() output with a value in [1, max_value] has a dense index in [0, encoding_count).
+    static constexpr int max_value = 10;
+    static constexpr size_t encoding_count = (size_t)Type::Artifact * max_value + (size_t)ArtifactType::Count;
+
+    /// <summary>
+    /// Index of the card that encodes exactly to x, or -1 if x is not such an encoding.
+    /// </summary>
+    static int encoding_index(cvec_slice x);
+    static Card from_encoding_index(int i);
 };
 
 const char* card_name(Card::Type t);
@@ -71,11 +81,12 @@ struct Encoded
 
     vec data;
 
-    vec_slice board() { return data.slice(0, board_size); }
     vec_slice me_cards_in() { return data.slice(board_size, me_cards * card_size); }
     vec_slice you_cards_in() { return data.slice(board_size + me_cards * card_size, you_cards * card_size); }
-    vec_slice me_card(int i) { return data.slice(board_size + i * card_size, card_size); }
-    vec_slice you_card(int i) { return data.slice(board_size + (i + me_cards) * card_size, card_size); }
+
+    cvec_slice board() const { return data.slice(0, board_size); }
+    cvec_slice me_card(int i) const { return data.slice(board_size + i * card_size, card_size); }
+    cvec_slice you_card(int i) const { return data.slice(board_size + (i + me_cards) * card_size, card_size); }
 
     int me_cards = 0;
     int you_cards = 0;
@@ -92,6 +103,8 @@ struct Game
     int mana = 0;
     bool played_land = false;
     Encoded encode() const;
+    // Overwrites e, reusing its storage.
+    void encode(Encoded& e) const;
 
     void init();
 
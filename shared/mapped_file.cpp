@@ -0,0 +1,86 @@
+#include "mapped_file.h"
+#include <fstream>
+#include <new>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr size_t heap_alignment = 64;
+
+std::shared_ptr<const mapped_file> mapped_file::open(const std::filesystem::path& path)
+{
+    std::shared_ptr<mapped_file> f(new mapped_file);
+#if defined(_WIN32)
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        // The view keeps the mapping object alive, so both handles can be closed once it exists.
+        HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+        {
+            f->m_data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+            if (f->m_data)
+            {
+                f->m_size = (size_t)size.QuadPart;
+                f->m_mapped = true;
+            }
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            f->m_data = static_cast<const char*>(p);
+            f->m_size = (size_t)st.st_size;
+            f->m_mapped = true;
+        }
+    }
+    ::close(fd);
+#endif
+    if (f->m_mapped) return f;
+
+    std::ifstream is(path, std::ios::binary | std::ios::ate);
+    if (!is) return nullptr;
+    const auto size = (size_t)is.tellg();
+    is.seekg(0);
+    if (size)
+    {
+        auto buf = static_cast<char*>(::operator new(size, std::align_val_t(heap_alignment)));
+        f->m_data = buf;
+        f->m_size = size;
+        if (!is.read(buf, size)) return nullptr;
+    }
+    return f;
+}
+
+mapped_file::~mapped_file()
+{
+    if (!m_data) return;
+    if (!m_mapped)
+    {
+        ::operator delete(const_cast<char*>(m_data), std::align_val_t(heap_alignment));
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<char*>(m_data), m_size);
+#endif
+}
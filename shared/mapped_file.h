@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+
+/// <summary>
+/// Read-only view of a whole file, memory mapped where the platform allows so that processes opening the same file
+/// share its pages. Falls back to reading the file into an aligned heap buffer.
+/// </summary>
+struct mapped_file
+{
+    /// <summary>
+    /// Returns nullptr if the file cannot be opened.
+    /// </summary>
+    static std::shared_ptr<const mapped_file> open(const std::filesystem::path& path);
+
+    ~mapped_file();
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    /// <summary>
+    /// Start of the file contents; aligned to at least 64 bytes.
+    /// </summary>
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    mapped_file() = default;
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+};
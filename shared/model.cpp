@@ -1,14 +1,34 @@
 #include "model.h"
+#include "autotune.h"
+#include "fixed_layer.h"
 #include "game.h"
+#include "mapped_file.h"
 #include "modeldims.h"
+#include "parallel.h"
 #include "rjwriter.h"
+#include "scratch.h"
 #include "vec.h"
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <ostream>
 #include <rapidjson/document.h>
+#include <rapidjson/memorystream.h>
 #include <rapidjson/writer.h>
+#include <stdexcept>
+#include <string_view>
+#include <variant>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 using rapidjson::Value;
 
 static const Value& find_or_throw(const Value& doc, const char* key)
@@ -18,6 +38,24 @@ static const Value& find_or_throw(const Value& doc, const char* key)
     return it->value;
 }
 
+void IModel::calc_batch(span<const Encoded> inputs, span<IEval*> evals, bool full) const
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+        calc(*evals[i], inputs[i], full);
+}
+
+void IModel::calc_both(IEval& e, IEval& e_full, const Encoded& input) const
+{
+    calc(e, input, false);
+    calc(e_full, input, true);
+}
+
+void IModel::backprop_batch(span<Encoded*> inputs, span<IEval*> evals, span<vec_slice> grads, bool full)
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+        backprop(*evals[i], *inputs[i], grads[i], full);
+}
+
 void deserialize(vec& data, const rapidjson::Value& v)
 {
     auto w = v.GetArray();
@@ -27,94 +65,451 @@ void deserialize(vec& data, const rapidjson::Value& v)
         data[i] = w[i].GetFloat();
     }
 }
+// Shortest text that reads back as exactly x, rather than the 17 digits Writer::Double spends on a float.
+static void write_float(RJWriter& w, float x)
+{
+    if (!std::isfinite(x))
+    {
+        w.Double(x);
+        return;
+    }
+    char buf[32];
+    auto r = std::to_chars(buf, buf + sizeof(buf), x);
+    w.RawValue(buf, r.ptr - buf, rapidjson::kNumberType);
+}
+
 void serialize(const vec& data, RJWriter& w)
 {
     w.StartArray();
     for (auto d : data)
-        w.Double(d);
+        write_float(w, d);
     w.EndArray();
 }
 
+// A Layer's "data" array as the streaming JSON loader set it aside: the unconverted text between the brackets and how
+// many numbers it holds. The document refers to it by the index the loader left in place of the array.
+struct LayerDataText
+{
+    std::string_view text;
+    size_t count = 0;
+};
+using LayerDataTexts = span<const LayerDataText>;
+
+// Convert the numbers of a layer data array into coefs[0, n) followed by state[0, 3n). If state is null, the state
+// numbers are not read at all. The text has already been through the JSON reader, so only separators sit between the
+// numbers.
+static void read_layer_data(std::string_view text, float* coefs, float* state, size_t n)
+{
+    const char* p = text.data();
+    const char* end = p + text.size();
+    const size_t count = state ? 4 * n : n;
+    for (size_t i = 0; i < count; ++i)
+    {
+        while (p != end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            ++p;
+        float x = 0;
+        auto r = std::from_chars(p, end, x);
+        if (r.ec != std::errc()) throw "Layer data is not an array of numbers";
+        p = r.ptr;
+        if (i < n)
+            coefs[i] = x;
+        else if (state)
+            state[i - n] = x;
+    }
+}
+
 struct Nonlinear
 {
-    void calc(vec_slice in, vec_slice out) const
+    void calc(cvec_slice in, vec_slice out) const
     {
-        for (int i = 0; i < in.size(); ++i)
+        for (size_t i = 0; i < in.size(); ++i)
         {
             out[i] = in[i] < 0 ? in[i] / 10 : in[i];
         }
     }
-    void backprop(vec_slice errs, vec_slice in, vec_slice grad) const
+    void backprop(vec_slice errs, cvec_slice in, vec_slice grad) const
     {
-        for (int i = 0; i < in.size(); ++i)
+        for (size_t i = 0; i < in.size(); ++i)
         {
             errs[i] = in[i] < 0 ? grad[i] / 10 : grad[i];
         }
     }
 };
 
+// One block of a Model's parameters: either a vec this process allocated or a read-only view into a mapped model
+// file. owner keeps the storage alive.
+//
+// Whether the block may be written in place is tracked explicitly rather than read off owner.use_count(), which is
+// only a hint while other threads copy and release their Models. A fresh arena is exclusive; copying the handle makes
+// both the copy and the source shared for good, so a Model that was copied from pays for one extra copy on its next
+// write even if the copy has since been dropped. Moving the handle keeps the flag.
+struct ParamArena
+{
+    float* data = nullptr;
+    size_t size = 0;
+    std::shared_ptr<const void> owner;
+    bool read_only = false;
+    // Set by make_arena. Atomic because copying a const Model (clone, freeze) from several threads at once clears it
+    // on the source.
+    mutable std::atomic<bool> exclusive{false};
+
+    ParamArena() = default;
+    ParamArena(const ParamArena& o) : data(o.data), size(o.size), owner(o.owner), read_only(o.read_only)
+    {
+        o.exclusive = false;
+    }
+    ParamArena(ParamArena&& o) noexcept { *this = std::move(o); }
+    ParamArena& operator=(const ParamArena& o)
+    {
+        if (this != &o) *this = ParamArena(o);
+        return *this;
+    }
+    ParamArena& operator=(ParamArena&& o) noexcept
+    {
+        if (this == &o) return *this;
+        data = o.data;
+        size = o.size;
+        owner = std::move(o.owner);
+        read_only = o.read_only;
+        exclusive = o.exclusive.load();
+        o.data = nullptr;
+        o.size = 0;
+        o.exclusive = false;
+        return *this;
+    }
+
+    explicit operator bool() const { return data != nullptr; }
+    // Writing in place would be seen by another Model, or would touch a mapped file.
+    bool shared() const { return read_only || !exclusive; }
+};
+
+static ParamArena make_arena(size_t n)
+{
+    auto v = std::make_shared<vec>();
+    v->realloc_uninitialized(n);
+#if defined(MADV_HUGEPAGE)
+    // Ask for transparent huge pages over the whole 2MB pages inside the buffer; only large models have any.
+    constexpr uintptr_t huge_page = uintptr_t(2) << 20;
+    auto begin = (reinterpret_cast<uintptr_t>(v->data()) + huge_page - 1) & ~(huge_page - 1);
+    auto end = reinterpret_cast<uintptr_t>(v->data() + n) & ~(huge_page - 1);
+    if (begin < end) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+#endif
+    ParamArena a;
+    a.data = v->data();
+    a.size = n;
+    a.owner = std::move(v);
+    a.exclusive = true;
+    return a;
+}
+
+static ParamArena copy_arena(const ParamArena& src)
+{
+    auto a = make_arena(src.size);
+    if (src.size) std::memcpy(a.data, src.data, src.size * sizeof(float));
+    return a;
+}
+
+// A layer's coefficients without their all-zero runs, for frozen layers that L1 normalization has left mostly zero.
+// Each input row keeps only its blocks of block_size consecutive outputs that hold a nonzero, stored densely so the
+// matvec still runs block_size wide.
+struct SparseCoefs
+{
+    static constexpr size_t block_size = 4;
+    // Layers with at most this fraction of nonzero blocks use the sparse kernel once frozen.
+    static constexpr float max_density = 0.5f;
+
+    // Blocks of input row i are [row_start[i], row_start[i + 1]).
+    std::vector<uint32_t> row_start;
+    // First output of each block.
+    std::vector<uint32_t> block_col;
+    // block_size coefficients per block, zero past the last output.
+    vec values;
+
+    // Number of blocks in the input rows of coefs (all but the bias row) that hold a nonzero, and of blocks overall.
+    static std::pair<size_t, size_t> count_blocks(mat_slice coefs)
+    {
+        size_t nonzero = 0, total = 0;
+        for (size_t i = 0; i + 1 < coefs.rows(); ++i)
+        {
+            auto row = coefs.row(i);
+            for (size_t j = 0; j < row.size(); j += block_size, ++total)
+            {
+                for (size_t k = j; k < std::min(row.size(), j + block_size); ++k)
+                {
+                    if (row[k] != 0)
+                    {
+                        ++nonzero;
+                        break;
+                    }
+                }
+            }
+        }
+        return {nonzero, total};
+    }
+
+    static std::shared_ptr<const SparseCoefs> build(mat_slice coefs)
+    {
+        auto s = std::make_shared<SparseCoefs>();
+        const size_t n = coefs.rows() - 1, cols = coefs.cols();
+        s->values.reserve(count_blocks(coefs).first * block_size);
+        s->row_start.push_back(0);
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto row = coefs.row(i);
+            for (size_t j = 0; j < cols; j += block_size)
+            {
+                const size_t end = std::min(cols, j + block_size);
+                if (std::all_of(row.begin() + j, row.begin() + end, [](float x) { return x == 0; })) continue;
+                s->block_col.push_back((uint32_t)j);
+                for (size_t k = j; k < j + block_size; ++k)
+                    s->values.push_back(k < end ? row[k] : 0.0f);
+            }
+            s->row_start.push_back((uint32_t)s->block_col.size());
+        }
+        return s;
+    }
+
+    // out = (input... 1) * coefs. Each output accumulates in the same order as the dense kernels, leaving out the zero
+    // terms, so results match them up to the sign of an exactly zero output.
+    void calc(mat_slice coefs, cvec_slice input, vec_slice out) const
+    {
+        const size_t cols = coefs.cols();
+        VEC_SCRATCH_VEC(acc, (cols + block_size - 1) / block_size * block_size);
+        acc.slice(0, cols).assign(coefs.last_row());
+        acc.slice(cols).assign(0);
+        for (size_t i = 0; i < input.size(); ++i)
+        {
+            const float x = input[i];
+            if (x == 0) continue;
+            for (uint32_t b = row_start[i]; b < row_start[i + 1]; ++b)
+            {
+                const float* v = values.begin() + b * block_size;
+                float* a = acc.data() + block_col[b];
+                for (size_t k = 0; k < block_size; ++k)
+                    a[k] += v[k] * x;
+            }
+        }
+        out.assign(acc.slice(0, cols));
+    }
+};
+
 struct Layer
 {
-    // float[4][In+1][Out]
-    vec m_data;
+    // Views into the owning Model's parameter arenas (see Model::bind_params): float[In+1][Out] coefficients, and
+    // float[3][In+1][Out] optimizer state holding g1s, g2s and delta. m_state is null once frozen. Until a Model binds
+    // the layer, randomize and deserialize keep its values in m_staged, float[4][In+1][Out], or, when loading through
+    // the streaming JSON reader, the text of its data array in m_staged_text, which bind converts straight into the
+    // arena; the Model binds before that text goes away.
+    float* m_coefs = nullptr;
+    float* m_state = nullptr;
+    std::shared_ptr<vec> m_staged;
+    std::string_view m_staged_text;
 
     int m_deltas = 0;
     int m_input = 0;
     int m_output = 0;
     int m_min_io = 0;
 
-    mat_slice coefs() { return mat_slice(m_data.data(), m_input, m_output); }
-    mat_slice g1s() { return mat_slice(m_data.data() + m_input * m_output, m_input, m_output); }
-    mat_slice g2s() { return mat_slice(m_data.data() + 2 * m_input * m_output, m_input, m_output); }
-    mat_slice delta() { return mat_slice(m_data.data() + 3 * m_input * m_output, m_input, m_output); }
+    // Set for layers fed by one-hot style encodings (Card::encode); calc then skips zero inputs.
+    bool m_sparse_input = false;
+    // Dense forward kernel, picked per shape by layer_autotuner the first time calc needs it.
+    layer_kernel_slot m_kernel;
+    // Compile-time sized kernel for this shape, if one was built; preferred over m_kernel for dense inputs.
+    fixed_layer_fn m_fixed = nullptr;
+    // Set by update_inference() for frozen layers that are sparse enough; preferred over every dense kernel.
+    std::shared_ptr<const SparseCoefs> m_sparse;
+    // The coefficients stored column-major, so each output's dot product reads one contiguous column instead of
+    // striding down the row-major matrix. update_inference() sets up an empty one for frozen dense layers, and the
+    // first calc that resolves to the dot kernel fills it; until then the kernel may not even be tuned yet.
+    struct TransposedCoefs
+    {
+        std::once_flag built;
+        vec data;
+    };
+    std::shared_ptr<TransposedCoefs> m_coefs_t;
+
+    mat_slice coefs() const { return mat_slice(m_coefs, m_input, m_output); }
+    transposed_mat_slice coefs_t() const { return transposed_mat_slice(m_coefs_t->data.data(), m_input, m_output); }
+    mat_slice g1s() { return mat_slice(m_state, m_input, m_output); }
+    mat_slice g2s() { return mat_slice(m_state + m_input * m_output, m_input, m_output); }
+    mat_slice delta() { return mat_slice(m_state + 2 * m_input * m_output, m_input, m_output); }
 
     int out_size() const { return m_output; }
     int in_size() const { return m_input - 1; }
+    size_t param_count() const { return (size_t)m_input * m_output; }
+
+    // Point the views at arena storage, first moving any staged values there. state may be null for a frozen layer.
+    void bind(float* coefs, float* state)
+    {
+        if (m_staged)
+        {
+            std::memcpy(coefs, m_staged->data(), param_count() * sizeof(float));
+            if (state) std::memcpy(state, m_staged->data() + param_count(), 3 * param_count() * sizeof(float));
+            m_staged.reset();
+        }
+        else if (!m_staged_text.empty())
+        {
+            read_layer_data(m_staged_text, coefs, state, param_count());
+            m_staged_text = {};
+        }
+        m_coefs = coefs;
+        m_state = state;
+        m_sparse.reset();
+        m_coefs_t.reset();
+        if (!m_state) m_deltas = 0;
+    }
+
+    // Rebuild or drop m_sparse and m_coefs_t to match the current coefficients. Only frozen layers keep them, since
+    // training would have to rebuild them after every step; backprop and learn always walk the row-major coefs.
+    void update_inference()
+    {
+        m_sparse.reset();
+        m_coefs_t.reset();
+        if (m_state) return;
+        auto [nonzero, total] = SparseCoefs::count_blocks(coefs());
+        if (nonzero <= SparseCoefs::max_density * total)
+        {
+            m_sparse = SparseCoefs::build(coefs());
+            return;
+        }
+        // The other kernels already read the coefficients a contiguous row at a time.
+        if (m_fixed || m_sparse_input) return;
+        m_coefs_t = std::make_shared<TransposedCoefs>();
+    }
+
+    // Fill m_coefs_t from the coefficients; runs once per update_inference().
+    void build_coefs_t() const
+    {
+        auto& t = m_coefs_t->data;
+        t.realloc_uninitialized(param_count());
+        for (int j = 0; j < m_output; ++j)
+            for (int i = 0; i < m_input; ++i)
+                t[(size_t)j * m_input + i] = m_coefs[(size_t)i * m_output + j];
+    }
+
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        f(*this);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        f(*this);
+    }
 
-    void calc(vec_slice input, vec_slice out)
+    void calc(cvec_slice input, vec_slice out) const
     {
-        out.assign_mv1_mult(coefs().transpose(), input);
+        if (m_sparse)
+        {
+            m_sparse->calc(coefs(), input, out);
+            out.slice(0, m_min_io).add(input.slice(0, m_min_io));
+            return;
+        }
+        if (m_fixed && !m_sparse_input)
+        {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+            if (input.size() != (size_t)in_size() || out.size() != (size_t)out_size()) std::terminate();
+#endif
+            return m_fixed(m_coefs, input.data(), out.data());
+        }
+        if (m_sparse_input)
+            out.assign_sparse_vm1_mult(coefs(), input);
+        else if (const auto kernel = m_kernel.get(m_input, m_output); kernel == LayerKernel::dot && m_coefs_t)
+        {
+            std::call_once(m_coefs_t->built, [this] { build_coefs_t(); });
+            parallel_for(m_output, m_input, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                    out[i] = coefs_t().col(i).dot1(input);
+            });
+        }
+        else
+            parallel_for(m_output, m_input, [&](size_t begin, size_t end) {
+                layer_forward(kernel, coefs(), input, out, begin, end);
+            });
 
         out.slice(0, m_min_io).add(input.slice(0, m_min_io));
     }
 
+    // outs[s] = calc(ins[s]) for a batch of samples, reading each weight row once for the whole batch.
+    void calc_batch(span<cvec_slice> ins, span<vec_slice> outs) const
+    {
+        if (m_sparse_input || m_sparse)
+        {
+            for (size_t s = 0; s < ins.size(); ++s)
+                calc(ins[s], outs[s]);
+            return;
+        }
+        parallel_for(ins.size(), m_input * m_output, [&](size_t begin, size_t end) {
+            assign_vm1_mult_batch(outs.subspan(begin, end - begin), coefs(), ins.subspan(begin, end - begin));
+        });
+        for (size_t s = 0; s < ins.size(); ++s)
+            outs[s].slice(0, m_min_io).add(ins[s].slice(0, m_min_io));
+    }
+
     void backprop_init()
     {
+        if (!m_state) std::terminate();
         m_deltas = 0;
         delta().flat().assign(0.0);
     }
 
-    void backprop(vec_slice errs, vec_slice input, vec_slice out, vec_slice grad)
+    void backprop(vec_slice errs, cvec_slice input, vec_slice out, vec_slice grad)
     {
-        errs.assign_mv_mult(coefs().slice_rows(0, coefs().rows() - 1), grad);
-        for (size_t j = 0; j < m_input - 1; ++j)
-        {
-            delta().row(j).fma(grad, input[j]);
-        }
+        if (!m_state) std::terminate();
+        parallel_for(m_input - 1, 2 * m_output, [&](size_t begin, size_t end) {
+            errs.slice(begin, end - begin).assign_mv_mult(coefs().slice_rows(begin, end - begin), grad);
+            delta().slice_rows(begin, end - begin).add_outer(input.slice(begin, end - begin), grad);
+        });
+        delta().last_row().add(grad);
 
         errs.slice(0, m_min_io).add(grad.slice(0, m_min_io));
 
-        delta().last_row().add(grad);
-
         ++m_deltas;
     }
 
+    // backprop() for a batch of samples. Each weight row is read once for the whole batch and delta is updated as a
+    // single rank-k product; per-element accumulation order matches calling backprop() for each sample in turn.
+    void backprop_batch(span<vec_slice> errs, span<cvec_slice> inputs, span<vec_slice> grads)
+    {
+        if (!m_state) std::terminate();
+        const size_t k = grads.size();
+        parallel_for(m_input - 1, 2 * m_output * k, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; ++j)
+            {
+                auto row = coefs().row(j);
+                for (size_t s = 0; s < k; ++s)
+                    errs[s][j] = row.dot(grads[s]);
+            }
+            delta().slice_rows(begin, end - begin).add_outer(inputs, grads, begin);
+        });
+        for (size_t s = 0; s < k; ++s)
+        {
+            errs[s].slice(0, m_min_io).add(grads[s].slice(0, m_min_io));
+            delta().last_row().add(grads[s]);
+        }
+        m_deltas += (int)k;
+    }
+
     void learn(float learn_rate)
     {
+        if (!m_state) std::terminate();
         if (m_deltas == 0) return;
 
-        for (size_t i = 0; i < delta().rows(); ++i)
-        {
-            delta().row(i).mult(1.0f / m_deltas);
-            g1s().row(i).decay_average(delta().row(i), 0.1f);
-            g2s().row(i).decay_variance(delta().row(i), 0.001f);
-
-            auto coef = coefs().row(i);
-            for (size_t j = 0; j < coef.size(); ++j)
+        parallel_for(delta().rows(), 8 * m_output, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
             {
-                coef[j] -= learn_rate * g1s().row(i)[j] / sqrt(g2s().row(i)[j] + 1e-8f);
+                delta().row(i).mult(1.0f / m_deltas);
+                g1s().row(i).decay_average(delta().row(i), 0.1f);
+                g2s().row(i).decay_variance(delta().row(i), 0.001f);
+
+                auto coef = coefs().row(i);
+                for (size_t j = 0; j < coef.size(); ++j)
+                {
+                    coef[j] -= learn_rate * g1s().row(i)[j] / sqrt(g2s().row(i)[j] + 1e-8f);
+                }
             }
-        }
+        });
     }
 
     void normalize(float learn_rate)
@@ -140,27 +535,68 @@ struct Layer
         m_input = input + 1;
         m_output = output;
         m_min_io = std::min(input, output);
-        m_data.realloc(m_input * m_output * 4, 0.0f);
+        m_staged = std::make_shared<vec>();
+        m_staged->realloc(4 * param_count(), 0.0f);
+        m_coefs = m_staged->data();
+        m_state = m_coefs + param_count();
         for (auto& v : coefs())
             v = (rand() * 2.0f / RAND_MAX - 1) / m_input;
+        choose_kernels();
+    }
+
+    void choose_kernels()
+    {
+        m_kernel.reset();
+        m_fixed = find_fixed_layer(m_input, m_output);
     }
 
-    void deserialize(const Value& v)
+    void deserialize(const Value& v, LayerDataTexts texts)
     {
         if (find_or_throw(v, "type") != "Layer") throw "Expected type Layer";
-        ::deserialize(m_data, find_or_throw(v, "data"));
         m_deltas = find_or_throw(v, "deltas").GetInt();
         m_input = find_or_throw(v, "input").GetInt();
         m_output = find_or_throw(v, "output").GetInt();
         m_min_io = find_or_throw(v, "min_io").GetInt();
+        choose_kernels();
+
+        // Layers read from a binary model file have no data here; the Model binds them to the file's blocks.
+        m_coefs = m_state = nullptr;
+        if (v.FindMember("data") == v.MemberEnd()) return;
+
+        // On disk, data is coefs followed by the optimizer state: float[4][In+1][Out].
+        auto& data = find_or_throw(v, "data");
+        if (!data.IsArray())
+        {
+            if (!data.IsUint() || data.GetUint() >= texts.size()) throw "Layer data is not an array";
+            auto& t = texts[data.GetUint()];
+            if (t.count != 4 * param_count()) throw "Layer data does not match its dimensions";
+            m_staged_text = t.text;
+            return;
+        }
+        m_staged = std::make_shared<vec>();
+        ::deserialize(*m_staged, data);
+        if (m_staged->size() != 4 * param_count()) throw "Layer data does not match its dimensions";
+        m_coefs = m_staged->data();
+        m_state = m_coefs + param_count();
     }
     void serialize(RJWriter& w) const
     {
         w.StartObject();
         w.Key("type");
         w.String("Layer");
-        w.Key("data");
-        ::serialize(m_data, w);
+        if (!w.omit_layer_data)
+        {
+            w.Key("data");
+            w.StartArray();
+            for (size_t i = 0; i < param_count(); ++i)
+                write_float(w, m_coefs[i]);
+            // A frozen layer keeps the on-disk layout with zero optimizer state.
+            for (size_t i = 0; i < 3 * param_count(); ++i)
+                write_float(w, m_state ? m_state[i] : 0.0f);
+            w.EndArray();
+            // Layer data is nearly all of a model, so a streaming writer never holds more than one layer.
+            w.drain();
+        }
         w.Key("deltas");
         w.Int(m_deltas);
         w.Key("input");
@@ -173,6 +609,32 @@ struct Layer
     }
 };
 
+// One evaluation's intermediates for a stack of layers (ReLULayers or a cascade): inner, out, then errs. A view into
+// the buffer Model::Eval lays everything out in, so binding it allocates nothing.
+struct LayersEval
+{
+    vec_slice m_data;
+    int m_inner_size = 0;
+    int m_out_size = 0;
+
+    template<class L>
+    static size_t size(const L& l)
+    {
+        return l.inner_size() + l.out_size() + l.in_size();
+    }
+    template<class L>
+    void bind(const L& l, vec_slice data)
+    {
+        m_data = data;
+        m_inner_size = l.inner_size();
+        m_out_size = l.out_size();
+    }
+
+    vec_slice inner() { return m_data.slice(0, m_inner_size); }
+    vec_slice out() { return m_data.slice(m_inner_size, m_out_size); }
+    vec_slice errs() { return m_data.slice(m_inner_size + m_out_size); }
+};
+
 struct ReLULayer
 {
     Layer l;
@@ -184,45 +646,57 @@ struct ReLULayer
     int inner_size() const { return l.out_size(); }
     int out_size() const { return l.out_size(); }
 
-    void calc(vec_slice in, vec_slice inner, vec_slice out)
+    void calc(cvec_slice in, vec_slice inner, vec_slice out) const
     {
         l.calc(in, inner);
         n.calc(inner, out);
     }
+    void calc_batch(span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> outs) const
+    {
+        l.calc_batch(ins, inners);
+        for (size_t s = 0; s < ins.size(); ++s)
+            n.calc(inners[s], outs[s]);
+    }
     void backprop_init() { l.backprop_init(); }
-    void backprop(vec_slice errs, vec_slice in, vec_slice inner, vec_slice grad)
+    void backprop(vec_slice errs, cvec_slice in, vec_slice inner, vec_slice grad)
     {
-        VEC_STACK_VEC(tmp, l.out_size());
+        VEC_SCRATCH_VEC(tmp, l.out_size());
 
         n.backprop(tmp, inner, grad);
         l.backprop(errs, in, inner, tmp);
     }
+    void backprop_batch(span<vec_slice> errs, span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> grads)
+    {
+        const size_t k = grads.size();
+        VEC_SCRATCH_VEC(tmp, l.out_size() * k);
+        std::vector<vec_slice> tmps(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            tmps[s] = tmp.slice(s * l.out_size(), l.out_size());
+            n.backprop(tmps[s], inners[s], grads[s]);
+        }
+        l.backprop_batch(errs, ins, tmps);
+    }
 
     void learn(float learn_rate) { l.learn(learn_rate); }
     void normalize(float learn_rate) { l.normalize(learn_rate); }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        f(l);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        f(l);
+    }
 
-    void deserialize(const Value& v) { l.deserialize(v); }
+    void deserialize(const Value& v, LayerDataTexts texts) { l.deserialize(v, texts); }
     void serialize(RJWriter& w) const { l.serialize(w); }
 };
 struct ReLULayers
 {
-    struct Eval
-    {
-        vec m_data;
-        int m_inner_size = 0;
-        int m_out_size = 0;
-
-        void realloc(int errs_size, int inner_size, int out_size)
-        {
-            m_inner_size = inner_size;
-            m_out_size = out_size;
-            m_data.realloc_uninitialized(inner_size + out_size + errs_size);
-        }
-
-        vec_slice inner() { return m_data.slice(0, m_inner_size); }
-        vec_slice out() { return m_data.slice(m_inner_size, m_out_size); }
-        vec_slice errs() { return m_data.slice(m_inner_size + m_out_size); }
-    };
+    using Eval = LayersEval;
 
     std::vector<ReLULayer> ls;
     int m_inner_size = 0;
@@ -231,6 +705,8 @@ struct ReLULayers
     int out_size() const { return ls.back().out_size(); }
     int inner_size() const { return m_inner_size; }
 
+    void set_sparse_input(bool sparse) { ls[0].l.m_sparse_input = sparse; }
+
     void randomize(const ModelDims& dims)
     {
         auto d = dims.dims;
@@ -262,15 +738,11 @@ struct ReLULayers
             l.backprop_init();
     }
 
-    void calc(Eval& e, vec_slice in)
-    {
-        e.realloc(in_size(), inner_size(), out_size());
-        this->calc(in, e.inner(), e.out());
-    }
+    void calc(Eval& e, cvec_slice in) const { this->calc(in, e.inner(), e.out()); }
 
-    void calc(vec_slice in, vec_slice inner, vec_slice out)
+    void calc(cvec_slice in, vec_slice inner, vec_slice out) const
     {
-        for (int i = 0; i < ls.size() - 1; ++i)
+        for (size_t i = 0; i < ls.size() - 1; ++i)
         {
             auto [cur_inner, x] = inner.split(ls[i].inner_size());
             auto [cur_out, new_inner] = x.split(ls[i].out_size());
@@ -281,8 +753,40 @@ struct ReLULayers
         ls.back().calc(in, inner, out);
     }
 
-    void backprop(Eval& e, vec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
-    void backprop(vec_slice errs, vec_slice in, vec_slice inner, vec_slice grad)
+    void calc_batch(span<Eval*> es, span<cvec_slice> ins) const
+    {
+        std::vector<vec_slice> inners(es.size()), outs(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            inners[s] = es[s]->inner();
+            outs[s] = es[s]->out();
+        }
+        calc_batch(ins, inners, outs);
+    }
+
+    void calc_batch(span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> outs) const
+    {
+        const size_t k = ins.size();
+        std::vector<cvec_slice> in(ins.begin(), ins.end());
+        std::vector<vec_slice> inner(inners.begin(), inners.end()), cur_inner(k), cur_out(k);
+        for (size_t i = 0; i < ls.size() - 1; ++i)
+        {
+            for (size_t s = 0; s < k; ++s)
+            {
+                auto [a, x] = inner[s].split(ls[i].inner_size());
+                auto [b, new_inner] = x.split(ls[i].out_size());
+                cur_inner[s] = a;
+                cur_out[s] = b;
+                inner[s] = new_inner;
+            }
+            ls[i].calc_batch(in, cur_inner, cur_out);
+            in.assign(cur_out.begin(), cur_out.end());
+        }
+        ls.back().calc_batch(in, inner, outs);
+    }
+
+    void backprop(Eval& e, cvec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
+    void backprop(vec_slice errs, cvec_slice in, vec_slice inner, vec_slice grad)
     {
         if (ls.size() == 0)
         {
@@ -296,10 +800,10 @@ struct ReLULayers
         else
         {
             int max_in = 0;
-            for (int i = 1; i < ls.size(); ++i)
+            for (size_t i = 1; i < ls.size(); ++i)
                 max_in += ls[i].in_size();
 
-            VEC_STACK_VEC(tmp, max_in);
+            VEC_SCRATCH_VEC(tmp, max_in);
 
             for (intptr_t i = ls.size() - 1; i > 0; --i)
             {
@@ -314,6 +818,53 @@ struct ReLULayers
             ls[0].backprop(errs, in, inner, grad);
         }
     }
+
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins, span<vec_slice> grads)
+    {
+        std::vector<vec_slice> errs(es.size()), inners(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            errs[s] = es[s]->errs();
+            inners[s] = es[s]->inner();
+        }
+        backprop_batch(errs, ins, inners, grads);
+    }
+    void backprop_batch(span<vec_slice> errs, span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> grads)
+    {
+        if (ls.size() == 1) return ls[0].backprop_batch(errs, ins, inners, grads);
+
+        const size_t k = grads.size();
+        int max_in = 0;
+        for (size_t i = 1; i < ls.size(); ++i)
+            max_in += ls[i].in_size();
+
+        VEC_SCRATCH_VEC(tmp_all, max_in * k);
+
+        std::vector<vec_slice> tmp(k), inner(inners.begin(), inners.end()), grad(grads.begin(), grads.end());
+        std::vector<vec_slice> cur_errs(k), cur_inner(k);
+        std::vector<cvec_slice> cur_in(k);
+        for (size_t s = 0; s < k; ++s)
+            tmp[s] = tmp_all.slice(s * max_in, max_in);
+
+        for (intptr_t i = ls.size() - 1; i > 0; --i)
+        {
+            for (size_t s = 0; s < k; ++s)
+            {
+                auto [x, a] = inner[s].rsplit(ls[i].inner_size());
+                auto [new_inner, b] = x.rsplit(ls[i].in_size());
+                auto [new_tmp, c] = tmp[s].rsplit(ls[i].in_size());
+                cur_inner[s] = a;
+                cur_in[s] = b;
+                cur_errs[s] = c;
+                inner[s] = new_inner;
+                tmp[s] = new_tmp;
+            }
+            ls[i].backprop_batch(cur_errs, cur_in, cur_inner, grad);
+            grad = cur_errs;
+        }
+        ls[0].backprop_batch(errs, ins, inner, grad);
+    }
+
     void learn(float learn_rate)
     {
         for (auto& l : ls)
@@ -324,8 +875,20 @@ struct ReLULayers
         for (auto& l : ls)
             l.normalize(learn_rate);
     }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+    }
 
-    void deserialize(const Value& v)
+    void deserialize(const Value& v, LayerDataTexts texts)
     {
         if (find_or_throw(v, "type") != "RELULayers") throw "Expected type RELULayers";
         m_inner_size = find_or_throw(v, "inner_size").GetInt();
@@ -333,7 +896,7 @@ struct ReLULayers
         ls.resize(data.Size());
         for (unsigned i = 0; i < data.Size(); ++i)
         {
-            ls[i].deserialize(data[i]);
+            ls[i].deserialize(data[i], texts);
         }
     }
 
@@ -362,25 +925,88 @@ struct ReLULayers
     }
 };
 
-struct ReLUCascade
+// Fused kernels for the 4-output blocks of ReLUCascade and ReLUCascade2. Block b reads the first in + 4b values of x
+// and appends its 4 outputs after them. Each block sums into one 4-wide accumulator over the whole prefix and applies
+// the residual and Nonlinear in the same pass, where going through ReLULayer would take a generic matvec over fresh
+// views and a separate Nonlinear pass. Accumulation order matches ReLULayer::calc/backprop with the axpy kernel.
+struct CascadeBlocks
 {
-    struct Eval
+    static constexpr int width = 4;
+
+    // x holds the cascade input and has room for every block's outputs; inner gets each block's pre-activations.
+    static void calc(const std::vector<ReLULayer>& ls, float* x, float* inner)
     {
-        vec m_data;
-        int m_inner_size = 0;
-        int m_out_size = 0;
+        for (auto& rl : ls)
+        {
+            auto& l = rl.l;
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+            if (l.out_size() != width) std::terminate();
+#endif
+            const int n = l.in_size();
+            const float* w = l.m_coefs;
+            float acc[width];
+            for (int j = 0; j < width; ++j)
+                acc[j] = w[n * width + j];
+            for (int i = 0; i < n; ++i)
+            {
+                const float xi = x[i];
+                const float* row = w + i * width;
+                for (int j = 0; j < width; ++j)
+                    acc[j] += row[j] * xi;
+            }
+            for (int j = 0; j < l.m_min_io; ++j)
+                acc[j] += x[j];
+            for (int j = 0; j < width; ++j)
+            {
+                inner[j] = acc[j];
+                x[n + j] = acc[j] < 0 ? acc[j] / 10 : acc[j];
+            }
+            inner += width;
+        }
+    }
 
-        void realloc(int errs_size, int inner_size, int out_size)
+    // Mirror of calc, last block first, accumulating each block's weight gradients. x and inner are as calc left them.
+    // grad holds the gradient for all of x and is left holding, in its first in values, the gradient for the input.
+    static void backprop(std::vector<ReLULayer>& ls, const float* x, const float* inner, float* grad)
+    {
+        inner += ls.size() * width;
+        for (size_t b = ls.size(); b > 0; --b)
         {
-            m_inner_size = inner_size;
-            m_out_size = out_size;
-            m_data.realloc_uninitialized(inner_size + out_size + errs_size);
+            auto& l = ls[b - 1].l;
+            if (!l.m_state) std::terminate();
+            inner -= width;
+            const int n = l.in_size();
+            const float* w = l.m_coefs;
+            float* d = l.delta().data();
+            float g[width];
+            for (int j = 0; j < width; ++j)
+                g[j] = inner[j] < 0 ? grad[n + j] / 10 : grad[n + j];
+            for (int i = 0; i < n; ++i)
+            {
+                const float* row = w + i * width;
+                float e = 0.0f;
+                for (int j = 0; j < width; ++j)
+                    e += row[j] * g[j];
+                if (i < l.m_min_io) e += g[i];
+                grad[i] += e;
+
+                // Zero inputs are skipped, as mat_slice::add_outer does.
+                const float xi = x[i];
+                if (xi == 0.0f) continue;
+                float* drow = d + i * width;
+                for (int j = 0; j < width; ++j)
+                    drow[j] += xi * g[j];
+            }
+            for (int j = 0; j < width; ++j)
+                d[n * width + j] += g[j];
+            ++l.m_deltas;
         }
+    }
+};
 
-        vec_slice inner() { return m_data.slice(0, m_inner_size); }
-        vec_slice out() { return m_data.slice(m_inner_size, m_out_size); }
-        vec_slice errs() { return m_data.slice(m_inner_size + m_out_size); }
-    };
+struct ReLUCascade
+{
+    using Eval = LayersEval;
 
     ReLULayer l_out;
     std::vector<ReLULayer> ls;
@@ -415,33 +1041,56 @@ struct ReLUCascade
         l_out.backprop_init();
     }
 
-    void calc(Eval& e, vec_slice in)
-    {
-        e.realloc(in_size(), inner_size(), out_size());
-        this->calc(in, e.inner(), e.out());
-    }
+    void calc(Eval& e, cvec_slice in) const { this->calc(in, e.inner(), e.out()); }
 
-    void calc(vec_slice in, vec_slice inner, vec_slice out)
+    void calc(cvec_slice in, vec_slice inner, vec_slice out) const
     {
         if (ls.size() == 0)
         {
             return l_out.calc(in, inner, out);
         }
         auto [tmp, a] = inner.split(l_out.in_size());
-        inner = a;
+        auto [blocks, l_out_inner] = a.split(ls.size() * CascadeBlocks::width);
         tmp.slice(0, in.size()).assign(in);
-        for (auto& l : ls)
+        CascadeBlocks::calc(ls, tmp.data(), blocks.data());
+        l_out.calc(tmp, l_out_inner, out);
+    }
+
+    void calc_batch(span<Eval*> es, span<cvec_slice> ins) const
+    {
+        std::vector<vec_slice> inners(es.size()), outs(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
         {
-            auto [cur_inner, new_inner] = inner.split(l.inner_size());
-            auto [cur_in, cur_out] = tmp.split(l.in_size());
-            l.calc(cur_in, cur_inner, cur_out.slice(0, 4));
-            inner = new_inner;
+            inners[s] = es[s]->inner();
+            outs[s] = es[s]->out();
+        }
+        calc_batch(ins, inners, outs);
+    }
+
+    void calc_batch(span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> outs) const
+    {
+        if (ls.size() == 0)
+        {
+            return l_out.calc_batch(ins, inners, outs);
         }
-        l_out.calc(tmp, inner, out);
+        // The blocks' weights are small enough to stay in cache, so they run per sample; only l_out is batched.
+        const size_t k = ins.size();
+        std::vector<vec_slice> tmp(k), inner(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto [t, a] = inners[s].split(l_out.in_size());
+            auto [blocks, l_out_inner] = a.split(ls.size() * CascadeBlocks::width);
+            tmp[s] = t;
+            inner[s] = l_out_inner;
+            tmp[s].slice(0, ins[s].size()).assign(ins[s]);
+            CascadeBlocks::calc(ls, t.data(), blocks.data());
+        }
+        std::vector<cvec_slice> l_out_ins(tmp.begin(), tmp.end());
+        l_out.calc_batch(l_out_ins, inner, outs);
     }
 
-    void backprop(Eval& e, vec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
-    void backprop(vec_slice errs, vec_slice in, vec_slice inner, vec_slice grad)
+    void backprop(Eval& e, cvec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
+    void backprop(vec_slice errs, cvec_slice in, vec_slice inner, vec_slice grad)
     {
         if (ls.size() == 0)
         {
@@ -449,27 +1098,54 @@ struct ReLUCascade
         }
         else
         {
-            VEC_STACK_VEC(tmp_grad, l_out.in_size());
-            VEC_STACK_VEC(tmp_errs, l_out.in_size() - 4);
+            VEC_SCRATCH_VEC(tmp_grad, l_out.in_size());
 
             auto [inner_in, x] = inner.split(l_out.in_size());
-            auto [y, l_out_out] = x.rsplit(l_out.inner_size());
-            inner = y;
+            auto [blocks, l_out_out] = x.split(ls.size() * CascadeBlocks::width);
 
             l_out.backprop(tmp_grad, inner_in, l_out_out, grad);
+            CascadeBlocks::backprop(ls, inner_in.data(), blocks.data(), tmp_grad.data());
+            errs.assign(tmp_grad.slice(0, errs.size()));
+        }
+    }
 
-            for (intptr_t i = ls.size(); i > 0; --i)
-            {
-                auto& l = ls[i - 1];
-                auto [x, cur_inner] = inner.rsplit(l.inner_size());
-                inner = x;
-                auto [new_grad, cur_grad] = tmp_grad.rsplit(4);
-                l.backprop(tmp_errs, inner_in.slice(0, l.in_size()), cur_inner, cur_grad);
-                tmp_grad = new_grad;
-                tmp_grad.add(tmp_errs);
-                tmp_errs = tmp_errs.slice(0, tmp_errs.size() - 4);
-            }
-            errs.assign(tmp_grad);
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins, span<vec_slice> grads)
+    {
+        std::vector<vec_slice> errs(es.size()), inners(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            errs[s] = es[s]->errs();
+            inners[s] = es[s]->inner();
+        }
+        backprop_batch(errs, ins, inners, grads);
+    }
+    void backprop_batch(span<vec_slice> errs, span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> grads)
+    {
+        if (ls.size() == 0) return l_out.backprop_batch(errs, ins, inners, grads);
+
+        const size_t k = grads.size();
+        const size_t grad_size = l_out.in_size();
+        VEC_SCRATCH_VEC(tmp_grad_all, grad_size * k);
+
+        std::vector<vec_slice> tmp_grad(k), blocks(k), l_out_out(k);
+        std::vector<cvec_slice> inner_in(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            tmp_grad[s] = tmp_grad_all.slice(s * grad_size, grad_size);
+            auto [a, x] = inners[s].split(l_out.in_size());
+            auto [y, b] = x.split(ls.size() * CascadeBlocks::width);
+            inner_in[s] = a;
+            blocks[s] = y;
+            l_out_out[s] = b;
+        }
+
+        l_out.backprop_batch(tmp_grad, inner_in, l_out_out, grads);
+
+        // Per sample, each block's weight gradients still accumulate in sample order.
+        for (size_t s = 0; s < k; ++s)
+        {
+            CascadeBlocks::backprop(ls, inner_in[s].data(), blocks[s].data(), tmp_grad[s].data());
+            errs[s].assign(tmp_grad[s].slice(0, errs[s].size()));
         }
     }
     void learn(float learn_rate)
@@ -484,8 +1160,22 @@ struct ReLUCascade
             l.normalize(learn_rate);
         l_out.normalize(learn_rate);
     }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+        l_out.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+        l_out.for_each_layer(f);
+    }
 
-    void deserialize(const Value& v)
+    void deserialize(const Value& v, LayerDataTexts texts)
     {
         if (find_or_throw(v, "type") != "ReLUCascade") throw "Expected type ReLUCascade";
         m_inner_size = find_or_throw(v, "inner_size").GetInt();
@@ -493,9 +1183,9 @@ struct ReLUCascade
         ls.resize(data.Size());
         for (unsigned i = 0; i < data.Size(); ++i)
         {
-            ls[i].deserialize(data[i]);
+            ls[i].deserialize(data[i], texts);
         }
-        l_out.deserialize(find_or_throw(v, "l_out"));
+        l_out.deserialize(find_or_throw(v, "l_out"), texts);
     }
 
     void serialize(RJWriter& w) const
@@ -520,23 +1210,7 @@ struct ReLUCascade
 
 struct ReLUCascade2
 {
-    struct Eval
-    {
-        vec m_data;
-        int m_inner_size = 0;
-        int m_out_size = 0;
-
-        void realloc(int errs_size, int inner_size, int out_size)
-        {
-            m_inner_size = inner_size;
-            m_out_size = out_size;
-            m_data.realloc_uninitialized(inner_size + out_size + errs_size);
-        }
-
-        vec_slice inner() { return m_data.slice(0, m_inner_size); }
-        vec_slice out() { return m_data.slice(m_inner_size, m_out_size); }
-        vec_slice errs() { return m_data.slice(m_inner_size + m_out_size); }
-    };
+    using Eval = LayersEval;
 
     ReLULayer l_out;
     std::vector<ReLULayer> ls;
@@ -571,33 +1245,56 @@ struct ReLUCascade2
         l_out.backprop_init();
     }
 
-    void calc(Eval& e, vec_slice in)
-    {
-        e.realloc(in_size(), inner_size(), out_size());
-        this->calc(in, e.inner(), e.out());
-    }
+    void calc(Eval& e, cvec_slice in) const { this->calc(in, e.inner(), e.out()); }
 
-    void calc(vec_slice in, vec_slice inner, vec_slice out)
+    void calc(cvec_slice in, vec_slice inner, vec_slice out) const
     {
         if (ls.size() == 0)
         {
             return l_out.calc(in, inner, out);
         }
         auto [tmp, a] = inner.split(l_out.in_size());
-        inner = a;
+        auto [blocks, l_out_inner] = a.split(ls.size() * CascadeBlocks::width);
         tmp.slice(0, in.size()).assign(in);
-        for (auto& l : ls)
+        CascadeBlocks::calc(ls, tmp.data(), blocks.data());
+        l_out.calc(tmp, l_out_inner, out);
+    }
+
+    void calc_batch(span<Eval*> es, span<cvec_slice> ins) const
+    {
+        std::vector<vec_slice> inners(es.size()), outs(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
         {
-            auto [cur_inner, new_inner] = inner.split(l.inner_size());
-            auto [cur_in, cur_out] = tmp.split(l.in_size());
-            l.calc(cur_in, cur_inner, cur_out.slice(0, 4));
-            inner = new_inner;
+            inners[s] = es[s]->inner();
+            outs[s] = es[s]->out();
+        }
+        calc_batch(ins, inners, outs);
+    }
+
+    void calc_batch(span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> outs) const
+    {
+        if (ls.size() == 0)
+        {
+            return l_out.calc_batch(ins, inners, outs);
+        }
+        // The blocks' weights are small enough to stay in cache, so they run per sample; only l_out is batched.
+        const size_t k = ins.size();
+        std::vector<vec_slice> tmp(k), inner(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto [t, a] = inners[s].split(l_out.in_size());
+            auto [blocks, l_out_inner] = a.split(ls.size() * CascadeBlocks::width);
+            tmp[s] = t;
+            inner[s] = l_out_inner;
+            tmp[s].slice(0, ins[s].size()).assign(ins[s]);
+            CascadeBlocks::calc(ls, t.data(), blocks.data());
         }
-        l_out.calc(tmp, inner, out);
+        std::vector<cvec_slice> l_out_ins(tmp.begin(), tmp.end());
+        l_out.calc_batch(l_out_ins, inner, outs);
     }
 
-    void backprop(Eval& e, vec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
-    void backprop(vec_slice errs, vec_slice in, vec_slice inner, vec_slice grad)
+    void backprop(Eval& e, cvec_slice in, vec_slice grad) { this->backprop(e.errs(), in, e.inner(), grad); }
+    void backprop(vec_slice errs, cvec_slice in, vec_slice inner, vec_slice grad)
     {
         if (ls.size() == 0)
         {
@@ -605,27 +1302,54 @@ struct ReLUCascade2
         }
         else
         {
-            VEC_STACK_VEC(tmp_grad, l_out.in_size());
-            VEC_STACK_VEC(tmp_errs, l_out.in_size() - 4);
+            VEC_SCRATCH_VEC(tmp_grad, l_out.in_size());
 
             auto [inner_in, x] = inner.split(l_out.in_size());
-            auto [y, l_out_out] = x.rsplit(l_out.inner_size());
-            inner = y;
+            auto [blocks, l_out_out] = x.split(ls.size() * CascadeBlocks::width);
 
             l_out.backprop(tmp_grad, inner_in, l_out_out, grad);
+            CascadeBlocks::backprop(ls, inner_in.data(), blocks.data(), tmp_grad.data());
+            errs.assign(tmp_grad.slice(0, errs.size()));
+        }
+    }
 
-            for (intptr_t i = ls.size(); i > 0; --i)
-            {
-                auto& l = ls[i - 1];
-                auto [x, cur_inner] = inner.rsplit(l.inner_size());
-                inner = x;
-                auto [new_grad, cur_grad] = tmp_grad.rsplit(4);
-                l.backprop(tmp_errs, inner_in.slice(0, l.in_size()), cur_inner, cur_grad);
-                tmp_grad = new_grad;
-                tmp_grad.add(tmp_errs);
-                tmp_errs = tmp_errs.slice(0, tmp_errs.size() - 4);
-            }
-            errs.assign(tmp_grad);
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins, span<vec_slice> grads)
+    {
+        std::vector<vec_slice> errs(es.size()), inners(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            errs[s] = es[s]->errs();
+            inners[s] = es[s]->inner();
+        }
+        backprop_batch(errs, ins, inners, grads);
+    }
+    void backprop_batch(span<vec_slice> errs, span<cvec_slice> ins, span<vec_slice> inners, span<vec_slice> grads)
+    {
+        if (ls.size() == 0) return l_out.backprop_batch(errs, ins, inners, grads);
+
+        const size_t k = grads.size();
+        const size_t grad_size = l_out.in_size();
+        VEC_SCRATCH_VEC(tmp_grad_all, grad_size * k);
+
+        std::vector<vec_slice> tmp_grad(k), blocks(k), l_out_out(k);
+        std::vector<cvec_slice> inner_in(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            tmp_grad[s] = tmp_grad_all.slice(s * grad_size, grad_size);
+            auto [a, x] = inners[s].split(l_out.in_size());
+            auto [y, b] = x.split(ls.size() * CascadeBlocks::width);
+            inner_in[s] = a;
+            blocks[s] = y;
+            l_out_out[s] = b;
+        }
+
+        l_out.backprop_batch(tmp_grad, inner_in, l_out_out, grads);
+
+        // Per sample, each block's weight gradients still accumulate in sample order.
+        for (size_t s = 0; s < k; ++s)
+        {
+            CascadeBlocks::backprop(ls, inner_in[s].data(), blocks[s].data(), tmp_grad[s].data());
+            errs[s].assign(tmp_grad[s].slice(0, errs[s].size()));
         }
     }
     void learn(float learn_rate)
@@ -640,8 +1364,22 @@ struct ReLUCascade2
             l.normalize(learn_rate);
         l_out.normalize(learn_rate);
     }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+        l_out.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        for (auto& l : ls)
+            l.for_each_layer(f);
+        l_out.for_each_layer(f);
+    }
 
-    void deserialize(const Value& v)
+    void deserialize(const Value& v, LayerDataTexts texts)
     {
         if (find_or_throw(v, "type").GetString() != std::string_view("ReLUCascade2"))
             throw "Expected type ReLUCascade2";
@@ -650,9 +1388,9 @@ struct ReLUCascade2
         ls.resize(data.Size());
         for (unsigned i = 0; i < data.Size(); ++i)
         {
-            ls[i].deserialize(data[i]);
+            ls[i].deserialize(data[i], texts);
         }
-        l_out.deserialize(find_or_throw(v, "l_out"));
+        l_out.deserialize(find_or_throw(v, "l_out"), texts);
     }
 
     void serialize(RJWriter& w) const
@@ -675,24 +1413,29 @@ struct ReLUCascade2
     ModelDims dims() const { return ModelDims{in_size(), (int)ls.size() * 4, out_size()}; }
 };
 
+// One of the layer stack architectures, chosen when the model is created or loaded. Only the chosen one is stored, and
+// each call visits it once, so the layer loops inside run without rechecking the choice.
 struct ReLUAny
 {
-    int k = 0;
-    ReLULayers a;
-    ReLUCascade b;
-    ReLUCascade2 c;
+    std::variant<ReLULayers, ReLUCascade, ReLUCascade2> m;
 
-    struct Eval
+    // Serialized type names, by variant index.
+    static constexpr const char* type_names[] = {"RELULayers", "ReLUCascade", "ReLUCascade2"};
+
+    // Every alternative shares the same Eval.
+    using Eval = LayersEval;
+
+    template<class F>
+    auto dispatch(F&& f)
     {
-        int k = 0;
-        ReLULayers::Eval a;
-        ReLUCascade::Eval b;
-        ReLUCascade2::Eval c;
+        return std::visit(std::forward<F>(f), m);
+    }
 
-        vec_slice inner() { return k == 0 ? a.inner() : (k == 1 ? b.inner() : c.inner()); }
-        vec_slice out() { return k == 0 ? a.out() : (k == 1 ? b.out() : c.out()); }
-        vec_slice errs() { return k == 0 ? a.errs() : (k == 1 ? b.errs() : c.errs()); }
-    };
+    template<class F>
+    auto dispatch(F&& f) const
+    {
+        return std::visit(std::forward<F>(f), m);
+    }
 
     int in_size() const
     {
@@ -706,17 +1449,31 @@ struct ReLUAny
     {
         return dispatch([](const auto& x) { return x.inner_size(); });
     }
+    size_t eval_size() const
+    {
+        return dispatch([](const auto& x) { return Eval::size(x); });
+    }
+    void bind_eval(Eval& e, vec_slice data) const
+    {
+        dispatch([&](const auto& x) { e.bind(x, data); });
+    }
+
+    // Select alternative k, default constructed.
+    void emplace(size_t k)
+    {
+        switch (k)
+        {
+            case 0: m.emplace<0>(); break;
+            case 1: m.emplace<1>(); break;
+            case 2: m.emplace<2>(); break;
+            default: std::terminate();
+        }
+    }
 
     void randomize(int type, const ModelDims& dims)
     {
-        if (dims.type == "RELULayers")
-            k = 0;
-        else if (dims.type == "ReLUCascade")
-            k = 1;
-        else if (dims.type == "ReLUCascade2")
-            k = 2;
-        else
-            k = type;
+        auto it = std::find(std::begin(type_names), std::end(type_names), std::string_view(dims.type));
+        emplace(it != std::end(type_names) ? it - std::begin(type_names) : type);
         return dispatch([&dims](auto& x) { return x.randomize(dims); });
     }
 
@@ -725,21 +1482,21 @@ struct ReLUAny
         return dispatch([](auto& x) { return x.backprop_init(); });
     }
 
-    void calc(Eval& e, vec_slice in)
+    void calc(Eval& e, cvec_slice in) const
     {
-        e.k = k;
-        if (k == 0) return a.calc(e.a, in);
-        if (k == 1) return b.calc(e.b, in);
-        if (k == 2) return c.calc(e.c, in);
-        std::terminate();
+        dispatch([&](const auto& x) { x.calc(e, in); });
     }
-
-    void backprop(Eval& e, vec_slice in, vec_slice grad)
+    void calc_batch(span<Eval*> es, span<cvec_slice> ins) const
     {
-        if (k == 0) return a.backprop(e.a, in, grad);
-        if (k == 1) return b.backprop(e.b, in, grad);
-        if (k == 2) return c.backprop(e.c, in, grad);
-        std::terminate();
+        dispatch([&](const auto& x) { x.calc_batch(es, ins); });
+    }
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins, span<vec_slice> grads)
+    {
+        dispatch([&](auto& x) { x.backprop_batch(es, ins, grads); });
+    }
+    void backprop(Eval& e, cvec_slice in, vec_slice grad)
+    {
+        dispatch([&](auto& x) { x.backprop(e, in, grad); });
     }
     void learn(float learn_rate)
     {
@@ -749,16 +1506,24 @@ struct ReLUAny
     {
         return dispatch([learn_rate](auto& x) { return x.normalize(learn_rate); });
     }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        dispatch([&f](auto& x) { x.for_each_layer(f); });
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        dispatch([&f](auto& x) { x.for_each_layer(f); });
+    }
 
-    void deserialize(const Value& v)
+    void deserialize(const Value& v, LayerDataTexts texts)
     {
-        auto type = find_or_throw(v, "type").GetString();
-        if (type == std::string_view("RELULayers"))
-            a.deserialize(v);
-        else if (type == std::string_view("ReLUCascade"))
-            b.deserialize(v);
-        else
-            c.deserialize(v);
+        auto type = std::string_view(find_or_throw(v, "type").GetString());
+        auto it = std::find(std::begin(type_names), std::end(type_names), type);
+        if (it == std::end(type_names)) throw "Expected type RELULayers, ReLUCascade or ReLUCascade2";
+        emplace(it - std::begin(type_names));
+        dispatch([&](auto& x) { x.deserialize(v, texts); });
     }
 
     void serialize(RJWriter& w) const
@@ -769,40 +1534,95 @@ struct ReLUAny
     ModelDims dims() const
     {
         auto d = dispatch([](const auto& x) { return x.dims(); });
-        if (k == 0) d.type = "RELULayers";
-        if (k == 1) d.type = "ReLUCascade";
-        if (k == 2) d.type = "ReLUCascade2";
+        d.type = type_names[m.index()];
         return d;
     }
+};
 
-    template<class F>
-    auto dispatch(F f)
+// Precomputed ReLULayers activations (inner and out) for every canonical Card encoding. The table records the
+// weights version it was built from and is only consulted while that version is current.
+struct CardTable
+{
+    // Shared between copies like Layer's weights; rebuild() writes a fresh buffer if this one is shared.
+    std::shared_ptr<vec> m_data;
+    int m_stride = 0;
+    int m_inner_size = 0;
+    unsigned m_version = 0;
+    // Whether m_data may be rebuilt in place, tracked like ParamArena::exclusive rather than read off use_count():
+    // set when rebuild() allocates, cleared on both the copy and the source when the table is copied.
+    mutable std::atomic<bool> m_exclusive{false};
+
+    CardTable() = default;
+    CardTable(const CardTable& o)
+        : m_data(o.m_data), m_stride(o.m_stride), m_inner_size(o.m_inner_size), m_version(o.m_version)
+    {
+        o.m_exclusive = false;
+    }
+    CardTable& operator=(const CardTable& o)
     {
-        if (k == 0) return f(a);
-        if (k == 1) return f(b);
-        if (k == 2) return f(c);
-        std::terminate();
+        if (this == &o) return *this;
+        m_data = o.m_data;
+        m_stride = o.m_stride;
+        m_inner_size = o.m_inner_size;
+        m_version = o.m_version;
+        m_exclusive = false;
+        o.m_exclusive = false;
+        return *this;
     }
 
-    template<class F>
-    auto dispatch(F f) const
+    void rebuild(ReLULayers& l, unsigned version)
+    {
+        m_inner_size = l.inner_size();
+        m_stride = l.inner_size() + l.out_size();
+        if (!m_data || !m_exclusive)
+        {
+            m_data = std::make_shared<vec>();
+            m_exclusive = true;
+        }
+        m_data->realloc_uninitialized(m_stride * Card::encoding_count);
+        float input[Card::encoded_size];
+        for (int i = 0; i < (int)Card::encoding_count; ++i)
+        {
+            Card::from_encoding_index(i).encode(input);
+            auto [inner, out] = m_data->slice(i * m_stride, m_stride).split(m_inner_size);
+            l.calc(input, inner, out);
+        }
+        m_version = version;
+    }
+
+    bool lookup(ReLULayers::Eval& e, cvec_slice input, unsigned version) const
     {
-        if (k == 0) return f(a);
-        if (k == 1) return f(b);
-        if (k == 2) return f(c);
-        std::terminate();
+        if (m_version != version || !m_data) return false;
+        auto i = Card::encoding_index(input);
+        if (i < 0) return false;
+        e.m_data.slice(0, m_stride).assign(m_data->slice(i * m_stride, m_stride));
+        return true;
+    }
+
+    // The table's output for input without copying it anywhere, or an empty slice where lookup() would fail.
+    vec_slice find_out(cvec_slice input, unsigned version) const
+    {
+        if (m_version != version || !m_data) return {};
+        auto i = Card::encoding_index(input);
+        if (i < 0) return {};
+        return m_data->slice(i * m_stride + m_inner_size, m_stride - m_inner_size);
     }
 };
 
 struct PerCardInputModel
 {
     ReLULayers l;
+    CardTable table;
+    unsigned version = 0;
+
     struct Eval
     {
-        vec grad;
+        vec_slice grad;
         ReLULayers::Eval l;
+        // Set by calc_out() to the table's output in place of filling l.
+        vec_slice table_out;
 
-        vec_slice out() { return l.out(); }
+        vec_slice out() { return table_out.size() ? table_out : l.out(); }
     };
 
     ModelDims dims() const { return l.dims(); }
@@ -810,39 +1630,136 @@ struct PerCardInputModel
     void randomize(int input_size, const std::vector<int>& middle, int output_size)
     {
         l.randomize(input_size, middle, output_size);
+        l.set_sparse_input(true);
     }
 
-    void calc(Eval& e, vec_slice input) { l.calc(e.l, input); }
+    void calc(Eval& e, cvec_slice input) const
+    {
+        e.table_out = {};
+        if (!table.lookup(e.l, input, version)) l.calc(e.l, input);
+    }
+    // Like calc, for when only e.out() is needed: a table hit leaves e pointing at the table instead of copying the
+    // card's activations into it. calc() must run again before backprop.
+    void calc_out(Eval& e, cvec_slice input) const
+    {
+        e.table_out = table.find_out(input, version);
+        if (!e.table_out.size()) calc(e, input);
+    }
     void backprop_init() { l.backprop_init(); }
-    void backprop(Eval& e, vec_slice input) { l.backprop(e.l, input, e.grad); }
-    void learn(float learn_rate) { l.learn(learn_rate); }
-    void normalize(float learn_rate) { l.normalize(learn_rate); }
-    void deserialize(const Value& v) { l.deserialize(v); }
+    void backprop(Eval& e, cvec_slice input) { l.backprop(e.l, input, e.grad); }
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins)
+    {
+        std::vector<ReLULayers::Eval*> ls(es.size());
+        std::vector<vec_slice> grads(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            ls[s] = &es[s]->l;
+            grads[s] = es[s]->grad;
+        }
+        l.backprop_batch(ls, ins, grads);
+    }
+    void learn(float learn_rate)
+    {
+        l.learn(learn_rate);
+        weights_changed();
+    }
+    void normalize(float learn_rate)
+    {
+        l.normalize(learn_rate);
+        weights_changed();
+    }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        l.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        l.for_each_layer(f);
+    }
+    void deserialize(const Value& v, LayerDataTexts texts)
+    {
+        l.deserialize(v, texts);
+        l.set_sparse_input(true);
+    }
     void serialize(RJWriter& w) const { l.serialize(w); }
+
+    // Also called by Model whenever it binds the layers to new parameters.
+    void weights_changed() { table.rebuild(l, ++version); }
 };
 
 struct PerYouCardInputModel
 {
     ReLULayers l;
+    CardTable table;
+    unsigned version = 0;
+
     struct Eval
     {
         ReLULayers::Eval l1;
-        vec_slice out() { return l1.out(); }
+        // Set by calc_out() to the table's output in place of filling l1.
+        vec_slice table_out;
+
+        vec_slice out() { return table_out.size() ? table_out : l1.out(); }
     };
 
     ModelDims dims() const { return l.dims(); }
     void randomize(int input_size, const std::vector<int>& middle, int output_size)
     {
         l.randomize(input_size, middle, output_size);
+        l.set_sparse_input(true);
     }
 
-    void calc(Eval& e, vec_slice input) { l.calc(e.l1, input); }
+    void calc(Eval& e, cvec_slice input) const
+    {
+        e.table_out = {};
+        if (!table.lookup(e.l1, input, version)) l.calc(e.l1, input);
+    }
+    // See PerCardInputModel::calc_out.
+    void calc_out(Eval& e, cvec_slice input) const
+    {
+        e.table_out = table.find_out(input, version);
+        if (!e.table_out.size()) calc(e, input);
+    }
     void backprop_init() { l.backprop_init(); }
-    void backprop(Eval& e, vec_slice input, vec_slice grad) { l.backprop(e.l1, input, grad); }
-    void learn(float lr) { l.learn(lr); }
-    void normalize(float lr) { l.normalize(lr); }
-    void deserialize(const Value& v) { l.deserialize(v); }
+    void backprop(Eval& e, cvec_slice input, vec_slice grad) { l.backprop(e.l1, input, grad); }
+    void backprop_batch(span<Eval*> es, span<cvec_slice> ins, span<vec_slice> grads)
+    {
+        std::vector<ReLULayers::Eval*> ls(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+            ls[s] = &es[s]->l1;
+        l.backprop_batch(ls, ins, grads);
+    }
+    void learn(float lr)
+    {
+        l.learn(lr);
+        weights_changed();
+    }
+    void normalize(float lr)
+    {
+        l.normalize(lr);
+        weights_changed();
+    }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        l.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        l.for_each_layer(f);
+    }
+    void deserialize(const Value& v, LayerDataTexts texts)
+    {
+        l.deserialize(v, texts);
+        l.set_sparse_input(true);
+    }
     void serialize(RJWriter& w) const { l.serialize(w); }
+
+    // Also called by Model whenever it binds the layers to new parameters.
+    void weights_changed() { table.rebuild(l, ++version); }
 };
 
 struct PerCardOutputModel
@@ -850,7 +1767,7 @@ struct PerCardOutputModel
     ReLULayers l;
     struct Eval
     {
-        vec input;
+        vec_slice input;
         ReLULayers::Eval l;
         vec_slice out() { return l.out(); }
         vec_slice err() { return l.errs(); }
@@ -859,12 +1776,44 @@ struct PerCardOutputModel
     ModelDims dims() const { return l.dims(); }
     void randomize(int input_size, const std::vector<int>& middle) { l.randomize(input_size, middle, 1); }
 
-    void calc(Eval& e) { l.calc(e.l, e.input); }
+    void calc(Eval& e) const { l.calc(e.l, e.input); }
+    void calc_batch(span<Eval*> es) const
+    {
+        std::vector<ReLULayers::Eval*> ls(es.size());
+        std::vector<cvec_slice> ins(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            ls[s] = &es[s]->l;
+            ins[s] = es[s]->input;
+        }
+        l.calc_batch(ls, ins);
+    }
     void backprop_init() { l.backprop_init(); }
     void backprop(Eval& e, vec_slice card_grad) { l.backprop(e.l, e.input, card_grad); }
+    void backprop_batch(span<Eval*> es, span<vec_slice> card_grads)
+    {
+        std::vector<ReLULayers::Eval*> ls(es.size());
+        std::vector<cvec_slice> ins(es.size());
+        for (size_t s = 0; s < es.size(); ++s)
+        {
+            ls[s] = &es[s]->l;
+            ins[s] = es[s]->input;
+        }
+        l.backprop_batch(ls, ins, card_grads);
+    }
     void learn(float lr) { l.learn(lr); }
     void normalize(float lr) { l.normalize(lr); }
-    void deserialize(const Value& v) { l.deserialize(v); }
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        l.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        l.for_each_layer(f);
+    }
+    void deserialize(const Value& v, LayerDataTexts texts) { l.deserialize(v, texts); }
     void serialize(RJWriter& w) const { l.serialize(w); }
 };
 
@@ -882,36 +1831,46 @@ struct Model final : IModel
 
     int card_out_width = 0;
 
+    // Every layer's parameters, back to back in for_each_layer order: coefficients in m_coefs_arena and g1s, g2s and
+    // delta at three times the same offset in m_state_arena (empty once frozen). Copies of a Model share both arenas;
+    // anything that writes one calls unshare_coefs() or unshare_state() first.
+    ParamArena m_coefs_arena;
+    ParamArena m_state_arena;
+
     struct LInput
     {
-        vec data;
+        vec_slice data;
         int board_out_width = 0;
 
-        void realloc_uninitialized(int w, int board_out_width)
-        {
-            data.realloc_uninitialized(w);
-            this->board_out_width = board_out_width;
-        }
-
         vec_slice all() { return data.slice(); }
         vec_slice board() { return data.slice(1, board_out_width); }
         vec_slice cards() { return data.slice(1 + board_out_width); }
         vec_slice full() { return data.slice(0, 1); }
     };
 
+    // Every intermediate of one evaluation lives in `data`, at offsets fixed by plan_eval() for the model's layer sizes
+    // and a maximum hand size, so an Eval is a single allocation reused across turns and games. The members are views.
     struct Eval : IEval
     {
+        vec data;
+        // What the layout was planned for; see fit_eval().
+        std::array<size_t, 6> shape = {};
+        int max_me_cards = 0;
+        int max_you_cards = 0;
+
         ReLUAny::Eval b;
         ReLUAny::Eval l;
 
         LInput l_input;
-        vec l_grad;
+        vec_slice l_grad;
 
         std::vector<PerCardInputModel::Eval> cards_in;
         std::vector<PerYouCardInputModel::Eval> you_cards_in;
         std::vector<PerCardOutputModel::Eval> cards_out;
 
-        vec all_out;
+        // The first avail_actions() entries of all_out_capacity.
+        vec_slice all_out;
+        vec_slice all_out_capacity;
 
         float out_p() { return all_out[0]; }
         float out_card(int i) { return all_out[i + 1]; }
@@ -923,7 +1882,7 @@ struct Model final : IModel
         {
             int x = 0;
             float win_pct = all_out[0];
-            for (int i = 1; i < all_out.size(); ++i)
+            for (int i = 1; i < (int)all_out.size(); ++i)
             {
                 auto p = all_out[i];
                 if (p > win_pct)
@@ -940,13 +1899,88 @@ struct Model final : IModel
         {
             for (int x = 0; x < i; ++x)
                 p = std::max(p, all_out[x]);
-            for (int x = i + 1; x < all_out.size(); ++x)
+            for (int x = i + 1; x < (int)all_out.size(); ++x)
                 p = std::max(p, all_out[x]);
             return std::max(0.0f, std::min(1.0f, p));
         }
     };
 
-    virtual std::unique_ptr<IEval> make_eval() { return std::make_unique<Eval>(); }
+    // Hands are planned for this many cards; an Eval grows the first time a game goes past it.
+    static constexpr int planned_hand_size = 16;
+
+    virtual std::unique_ptr<IEval> make_eval() const override
+    {
+        auto e = std::make_unique<Eval>();
+        plan_eval(*e, planned_hand_size, planned_hand_size);
+        return e;
+    }
+
+    std::array<size_t, 6> eval_shape() const
+    {
+        return {b.eval_size(),
+                l.eval_size(),
+                (size_t)l.in_size(),
+                LayersEval::size(card_in_model.l),
+                LayersEval::size(you_card_in_model.l),
+                LayersEval::size(card_out_model.l)};
+    }
+
+    // Carve e's views out of consecutive 64-byte aligned pieces handed out by take(n).
+    template<class Take>
+    void layout_eval(Eval& e, Take&& take) const
+    {
+        b.bind_eval(e.b, take(b.eval_size()));
+        l.bind_eval(e.l, take(l.eval_size()));
+        e.l_input.data = take(l.in_size());
+        e.l_input.board_out_width = b.out_size();
+        e.l_grad = take(p.in_size());
+        e.all_out_capacity = take(e.max_me_cards + 1);
+        for (auto& c : e.cards_in)
+        {
+            c.grad = take(card_out_width);
+            c.l.bind(card_in_model.l, take(LayersEval::size(card_in_model.l)));
+        }
+        for (auto& c : e.you_cards_in)
+            c.l1.bind(you_card_in_model.l, take(LayersEval::size(you_card_in_model.l)));
+        for (auto& c : e.cards_out)
+        {
+            c.input = take(l.out_size() + card_out_width);
+            c.l.bind(card_out_model.l, take(LayersEval::size(card_out_model.l)));
+        }
+    }
+
+    void plan_eval(Eval& e, int max_me_cards, int max_you_cards) const
+    {
+        e.shape = eval_shape();
+        e.max_me_cards = max_me_cards;
+        e.max_you_cards = max_you_cards;
+        e.cards_in.resize(max_me_cards);
+        e.cards_out.resize(max_me_cards);
+        e.you_cards_in.resize(max_you_cards);
+
+        auto padded = [](size_t n) { return (n + 15) & ~size_t(15); };
+        size_t total = 0;
+        layout_eval(e, [&](size_t n) {
+            total += padded(n);
+            return vec_slice();
+        });
+        e.data.realloc_uninitialized(total);
+        size_t offset = 0;
+        layout_eval(e, [&](size_t n) {
+            vec_slice v(e.data.data() + offset, n);
+            offset += padded(n);
+            return v;
+        });
+    }
+
+    // Re-plan e if it was laid out for differently sized layers or smaller hands. Hands grow geometrically, so this
+    // happens a handful of times per Eval at most. Must run before anything is written to e.
+    void fit_eval(Eval& e, const Encoded& g) const
+    {
+        if (e.shape == eval_shape() && g.me_cards <= e.max_me_cards && g.you_cards <= e.max_you_cards) return;
+        auto grow = [](int need, int have) { return need <= have ? have : std::max(need, 2 * have); };
+        plan_eval(e, grow(g.me_cards, e.max_me_cards), grow(g.you_cards, e.max_you_cards));
+    }
 
     void randomize(int board_size, int card_size, const ModelDims& dims)
     {
@@ -970,6 +2004,7 @@ struct Model final : IModel
 
         p.randomize(l3_out_width, 1);
         card_out_model.randomize(l3_out_width + card_out_width, dims.children.at("card_out").dims);
+        pack_params();
     }
     virtual std::unique_ptr<ModelDims> dims() const override
     {
@@ -991,47 +2026,186 @@ struct Model final : IModel
         }));
     }
 
-    virtual void calc(IEval& e, Encoded& g, bool full) override { calc_inner((Eval&)e, g, full); }
-    void calc_inner(Eval& e, Encoded& g, bool full)
+    virtual void calc(IEval& e, const Encoded& g, bool full) const override { calc_inner((Eval&)e, g, full); }
+    void calc_inner(Eval& e, const Encoded& g, bool full) const
     {
+        fit_eval(e, g);
         b.calc(e.b, g.board());
-        e.l_input.realloc_uninitialized(1 + b.out_size() + card_out_width, b.out_size());
-        e.l_input.full()[0] = full;
+        calc_l_input(e, g, full);
+        calc_from_l(e, g);
+    }
+
+    // The board model, my cards' input models and their sum do not depend on full, so they run once and are copied
+    // into the full Eval; only you_card_in_model and the stages after it run twice.
+    virtual void calc_both(IEval& e, IEval& e_full, const Encoded& g) const override
+    {
+        auto& a = (Eval&)e;
+        auto& f = (Eval&)e_full;
+        fit_eval(a, g);
+        fit_eval(f, g);
+        b.calc(a.b, g.board());
+        calc_me_l_input(a, g);
+
+        f.b.inner().assign(a.b.inner());
+        f.b.out().assign(a.b.out());
+        f.l_input.board().assign(a.l_input.board());
+        f.l_input.cards().assign(a.l_input.cards());
+        for (int i = 0; i < g.me_cards; ++i)
+        {
+            f.cards_in[i].table_out = a.cards_in[i].table_out;
+            if (a.cards_in[i].table_out.size()) continue;
+            f.cards_in[i].l.inner().assign(a.cards_in[i].l.inner());
+            f.cards_in[i].l.out().assign(a.cards_in[i].l.out());
+        }
+
+        calc_you_l_input(a, g, false);
+        calc_you_l_input(f, g, true);
+        calc_from_l(a, g);
+        calc_from_l(f, g);
+    }
+
+    // Everything from l onwards, once e.l_input is filled.
+    void calc_from_l(Eval& e, const Encoded& g) const
+    {
+        l.calc(e.l, e.l_input.all());
+        e.all_out = e.all_out_capacity.slice(0, g.avail_actions());
+        p.calc(e.l.out(), e.all_out.slice(0, 1));
+        for (int i = 0; i < g.me_cards; ++i)
+        {
+            calc_card_out_input(e, i);
+            card_out_model.calc(e.cards_out[i]);
+            e.all_out[i + 1] = e.cards_out[i].out()[0];
+        }
+    }
+
+    // Same stages as calc_inner, with b, l, p and card_out run once over the whole batch. Hands of different sizes are
+    // handled by flattening every (sample, card) pair into a single card_out batch.
+    virtual void calc_batch(span<const Encoded> inputs, span<IEval*> evals, bool full) const override
+    {
+        const size_t k = inputs.size();
+        std::vector<ReLUAny::Eval*> sub(k);
+        std::vector<cvec_slice> ins(k);
+        std::vector<vec_slice> outs(k);
+
+        for (size_t s = 0; s < k; ++s)
+        {
+            fit_eval(*(Eval*)evals[s], inputs[s]);
+            sub[s] = &((Eval*)evals[s])->b;
+            ins[s] = inputs[s].board();
+        }
+        b.calc_batch(sub, ins);
+
+        size_t total_cards = 0;
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            calc_l_input(e, inputs[s], full);
+            sub[s] = &e.l;
+            ins[s] = e.l_input.all();
+            total_cards += inputs[s].me_cards;
+        }
+        l.calc_batch(sub, ins);
+
+        std::vector<PerCardOutputModel::Eval*> cards;
+        cards.reserve(total_cards);
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            e.all_out = e.all_out_capacity.slice(0, inputs[s].avail_actions());
+            ins[s] = e.l.out();
+            outs[s] = e.all_out.slice(0, 1);
+            for (int i = 0; i < inputs[s].me_cards; ++i)
+            {
+                calc_card_out_input(e, i);
+                cards.push_back(&e.cards_out[i]);
+            }
+        }
+        p.calc_batch(ins, outs);
+        card_out_model.calc_batch(cards);
+
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            for (int i = 0; i < inputs[s].me_cards; ++i)
+                e.all_out[i + 1] = e.cards_out[i].out()[0];
+        }
+    }
+
+    // Fill e.l_input from the board output and the per-card input models.
+    void calc_l_input(Eval& e, const Encoded& g, bool full) const
+    {
+        calc_me_l_input(e, g);
+        calc_you_l_input(e, g, full);
+    }
+
+    // The part of l_input that does not depend on full: the board output and the sum over my cards.
+    void calc_me_l_input(Eval& e, const Encoded& g) const
+    {
         e.l_input.board().assign(e.b.out());
         auto l_input_cards = e.l_input.cards();
         l_input_cards.assign(0);
-        e.cards_in.resize(g.me_cards);
-        e.cards_out.resize(g.me_cards);
-        e.you_cards_in.resize(g.you_cards);
 
+        const bool keep = keep_card_activations();
         for (int i = 0; i < g.me_cards; ++i)
         {
-            card_in_model.calc(e.cards_in[i], g.me_card(i));
+            if (keep)
+                card_in_model.calc(e.cards_in[i], g.me_card(i));
+            else
+                card_in_model.calc_out(e.cards_in[i], g.me_card(i));
             l_input_cards.add(e.cards_in[i].out());
         }
-        if (full)
+    }
+
+    // The full flag and, when set, the opponent's cards added onto the card sum.
+    void calc_you_l_input(Eval& e, const Encoded& g, bool full) const
+    {
+        e.l_input.full()[0] = full;
+        if (!full) return;
+        auto l_input_cards = e.l_input.cards();
+        const bool keep = keep_card_activations();
+        for (int i = 0; i < g.you_cards; ++i)
         {
-            for (int i = 0; i < g.you_cards; ++i)
-            {
+            if (keep)
                 you_card_in_model.calc(e.you_cards_in[i], g.you_card(i));
-                l_input_cards.add(e.you_cards_in[i].out());
-            }
+            else
+                you_card_in_model.calc_out(e.you_cards_in[i], g.you_card(i));
+            l_input_cards.add(e.you_cards_in[i].out());
         }
-        l.calc(e.l, e.l_input.all());
-        e.all_out.realloc_uninitialized(g.avail_actions());
-        p.calc(e.l.out(), e.all_out.slice(0, 1));
+    }
+
+    // The card input models are already tables of their outputs for every card, so the card sums in l_input cost a
+    // lookup per card. The activations behind each output are only needed for backprop, which a frozen model cannot
+    // do, so frozen models read the outputs in place and skip copying the activations into the Eval.
+    bool keep_card_activations() const { return (bool)m_state_arena; }
+
+    // Fill in the activations an inference-only calc left out, for an Eval computed before backprop_init().
+    void fill_card_activations(Eval& e, const Encoded& g, bool full) const
+    {
         for (int i = 0; i < g.me_cards; ++i)
+            if (e.cards_in[i].table_out.size()) card_in_model.calc(e.cards_in[i], g.me_card(i));
+        if (full)
         {
-            e.cards_out[i].input.realloc_uninitialized(l.out_size() + card_out_width);
-            e.cards_out[i].input.slice(l.out_size()).assign(e.cards_in[i].out());
-            e.cards_out[i].input.slice(0, l.out_size()).assign(e.l.out());
-            card_out_model.calc(e.cards_out[i]);
-            e.all_out[i + 1] = e.cards_out[i].out()[0];
+            for (int i = 0; i < g.you_cards; ++i)
+                if (e.you_cards_in[i].table_out.size()) you_card_in_model.calc(e.you_cards_in[i], g.you_card(i));
         }
     }
 
+    void calc_card_out_input(Eval& e, int i) const
+    {
+        e.cards_out[i].input.slice(l.out_size()).assign(e.cards_in[i].out());
+        e.cards_out[i].input.slice(0, l.out_size()).assign(e.l.out());
+    }
+
     virtual void backprop_init() override
     {
+        if (!m_state_arena)
+        {
+            // Training a frozen model starts again from fresh optimizer state.
+            m_state_arena = make_arena(3 * m_coefs_arena.size);
+            std::fill_n(m_state_arena.data, m_state_arena.size, 0.0f);
+            bind_params();
+        }
+        unshare_state();
         b.backprop_init();
         l.backprop_init();
         p.backprop_init();
@@ -1043,17 +2217,18 @@ struct Model final : IModel
 
     virtual void backprop(IEval& e, Encoded& g, vec_slice grad, bool full) override
     {
+        unshare_state();
         backprop_inner((Eval&)e, g, grad, full);
     }
     void backprop_inner(Eval& e, Encoded& g, vec_slice grad, bool full)
     {
+        fill_card_activations(e, g, full);
         vec_slice p_grad = grad.slice(0, 1);
         vec_slice cards_grad = grad.slice(1);
 
-        e.l_grad.realloc_uninitialized(p.in_size());
         p.backprop(e.l_grad, e.l.out(), e.all_out.slice(0, 1), p_grad);
 
-        for (int i = 0; i < cards_grad.size(); ++i)
+        for (size_t i = 0; i < cards_grad.size(); ++i)
         {
             card_out_model.backprop(e.cards_out[i], cards_grad.slice(i, 1));
             e.l_grad.slice().add(e.cards_out[i].err().slice(0, l.out_size()));
@@ -1070,14 +2245,103 @@ struct Model final : IModel
         }
         for (int i = 0; i < g.me_cards; ++i)
         {
-            e.cards_in[i].grad.realloc_uninitialized(e.cards_in[i].out().size());
-            e.cards_in[i].grad.slice().assign_add(l_card_errs, e.cards_out[i].err().slice(l.out_size()));
+            e.cards_in[i].grad.assign(l_card_errs + e.cards_out[i].err().slice(l.out_size()));
             card_in_model.backprop(e.cards_in[i], g.me_card(i));
         }
         b.backprop(e.b, g.board(), e.l.errs().slice(1, b.out_size()));
     }
+
+    // Same stages as backprop_inner, each run once over the whole batch. Per-card stages are flattened over every
+    // (sample, card) pair in sample order, so every delta accumulates in the same order as per-sample backprop.
+    virtual void backprop_batch(span<Encoded*> inputs, span<IEval*> evals, span<vec_slice> grads, bool full) override
+    {
+        unshare_state();
+        const size_t k = inputs.size();
+        std::vector<cvec_slice> ins(k);
+        std::vector<vec_slice> outs(k), sub_grads(k);
+
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            fill_card_activations(e, *inputs[s], full);
+            outs[s] = e.l_grad;
+            ins[s] = e.l.out();
+            sub_grads[s] = grads[s].slice(0, 1);
+        }
+        p.backprop_batch(outs, ins, sub_grads);
+
+        std::vector<PerCardOutputModel::Eval*> cards_out;
+        std::vector<vec_slice> cards_grad;
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            for (size_t i = 0; i + 1 < grads[s].size(); ++i)
+            {
+                cards_out.push_back(&e.cards_out[i]);
+                cards_grad.push_back(grads[s].slice(i + 1, 1));
+            }
+        }
+        card_out_model.backprop_batch(cards_out, cards_grad);
+
+        std::vector<ReLUAny::Eval*> sub(k);
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            for (size_t i = 0; i + 1 < grads[s].size(); ++i)
+                e.l_grad.slice().add(e.cards_out[i].err().slice(0, l.out_size()));
+            sub[s] = &e.l;
+            ins[s] = e.l_input.all();
+            sub_grads[s] = e.l_grad;
+        }
+        l.backprop_batch(sub, ins, sub_grads);
+
+        if (full)
+        {
+            std::vector<PerYouCardInputModel::Eval*> you_cards;
+            std::vector<cvec_slice> you_ins;
+            std::vector<vec_slice> you_grads;
+            for (size_t s = 0; s < k; ++s)
+            {
+                auto& e = *(Eval*)evals[s];
+                auto l_card_errs = e.l.errs().slice(1 + b.out_size());
+                for (int i = 0; i < inputs[s]->you_cards; ++i)
+                {
+                    you_cards.push_back(&e.you_cards_in[i]);
+                    you_ins.push_back(inputs[s]->you_card(i));
+                    you_grads.push_back(l_card_errs);
+                }
+            }
+            you_card_in_model.backprop_batch(you_cards, you_ins, you_grads);
+        }
+
+        std::vector<PerCardInputModel::Eval*> cards_in;
+        std::vector<cvec_slice> cards_in_ins;
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            auto l_card_errs = e.l.errs().slice(1 + b.out_size());
+            for (int i = 0; i < inputs[s]->me_cards; ++i)
+            {
+                e.cards_in[i].grad.assign(l_card_errs + e.cards_out[i].err().slice(l.out_size()));
+                cards_in.push_back(&e.cards_in[i]);
+                cards_in_ins.push_back(inputs[s]->me_card(i));
+            }
+        }
+        card_in_model.backprop_batch(cards_in, cards_in_ins);
+
+        for (size_t s = 0; s < k; ++s)
+        {
+            auto& e = *(Eval*)evals[s];
+            sub[s] = &e.b;
+            ins[s] = inputs[s]->board();
+            sub_grads[s] = e.l.errs().slice(1, b.out_size());
+        }
+        b.backprop_batch(sub, ins, sub_grads);
+    }
     void learn(float lr)
     {
+        unshare_state();
+        unshare_coefs();
         b.learn(lr);
         l.learn(lr);
         p.learn(lr);
@@ -1089,12 +2353,88 @@ struct Model final : IModel
 
     void normalize(float lr)
     {
+        unshare_coefs();
         b.normalize(lr);
         l.normalize(lr);
         p.normalize(lr);
         card_in_model.normalize(lr);
         you_card_in_model.normalize(lr);
         card_out_model.normalize(lr);
+        if (!m_state_arena) for_each_layer([](Layer& x) { x.update_inference(); });
+    }
+    void freeze_in_place()
+    {
+        m_state_arena = {};
+        bind_params();
+    }
+
+    template<class F>
+    void for_each_layer(F&& f)
+    {
+        b.for_each_layer(f);
+        l.for_each_layer(f);
+        p.for_each_layer(f);
+        card_in_model.for_each_layer(f);
+        you_card_in_model.for_each_layer(f);
+        card_out_model.for_each_layer(f);
+    }
+    template<class F>
+    void for_each_layer(F&& f) const
+    {
+        b.for_each_layer(f);
+        l.for_each_layer(f);
+        p.for_each_layer(f);
+        card_in_model.for_each_layer(f);
+        you_card_in_model.for_each_layer(f);
+        card_out_model.for_each_layer(f);
+    }
+
+    // Layers start on a 64-byte boundary, as each did when it owned its own vec.
+    static size_t arena_stride(const Layer& x) { return (x.param_count() + 15) & ~size_t(15); }
+
+    size_t arena_size()
+    {
+        size_t n = 0;
+        for_each_layer([&](Layer& x) { n += arena_stride(x); });
+        return n;
+    }
+
+    // Move every layer's staged values into newly allocated arenas. A frozen model gets no state arena, and layers
+    // staged as text skip their state numbers.
+    void pack_params(bool frozen = false)
+    {
+        const size_t n = arena_size();
+        adopt_params(make_arena(n), frozen ? ParamArena{} : make_arena(3 * n));
+    }
+    // Bind the layers to arenas laid out as arena_size() describes; state may be empty for a frozen model.
+    void adopt_params(ParamArena coefs, ParamArena state)
+    {
+        m_coefs_arena = std::move(coefs);
+        m_state_arena = std::move(state);
+        bind_params();
+        card_in_model.weights_changed();
+        you_card_in_model.weights_changed();
+    }
+    void bind_params()
+    {
+        size_t offset = 0;
+        for_each_layer([&](Layer& x) {
+            x.bind(m_coefs_arena.data + offset, m_state_arena ? m_state_arena.data + 3 * offset : nullptr);
+            offset += arena_stride(x);
+        });
+        if (!m_state_arena) for_each_layer([](Layer& x) { x.update_inference(); });
+    }
+    void unshare_coefs()
+    {
+        if (!m_coefs_arena.shared()) return;
+        m_coefs_arena = copy_arena(m_coefs_arena);
+        bind_params();
+    }
+    void unshare_state()
+    {
+        if (!m_state_arena || !m_state_arena.shared()) return;
+        m_state_arena = copy_arena(m_state_arena);
+        bind_params();
     }
 
     virtual void serialize(RJWriter& w) const override
@@ -1123,19 +2463,56 @@ struct Model final : IModel
         w.EndObject();
     }
 
-    void deserialize(const Value& doc)
+    // texts holds the layer data arrays the streaming JSON loader set aside; it must outlive this call. With frozen
+    // set the model is loaded already frozen, without its optimizer state.
+    void deserialize(const Value& doc, LayerDataTexts texts, bool frozen = false)
+    {
+        deserialize_structure(doc, texts);
+        pack_params(frozen);
+    }
+    // Everything but binding the layers, whose data may be in doc or texts or, for a binary file, in its parameter
+    // blocks.
+    void deserialize_structure(const Value& doc, LayerDataTexts texts)
     {
         if (find_or_throw(doc, "type") != "Model") throw "Expected type Model";
-        b.deserialize(find_or_throw(doc, "b"));
-        l.deserialize(find_or_throw(doc, "l"));
-        p.deserialize(find_or_throw(doc, "p"));
-        card_in_model.deserialize(find_or_throw(doc, "in"));
-        you_card_in_model.deserialize(find_or_throw(doc, "you_in"));
-        card_out_model.deserialize(find_or_throw(doc, "out"));
+        b.deserialize(find_or_throw(doc, "b"), texts);
+        l.deserialize(find_or_throw(doc, "l"), texts);
+        p.deserialize(find_or_throw(doc, "p"), texts);
+        card_in_model.deserialize(find_or_throw(doc, "in"), texts);
+        you_card_in_model.deserialize(find_or_throw(doc, "you_in"), texts);
+        card_out_model.deserialize(find_or_throw(doc, "out"), texts);
         card_out_width = find_or_throw(doc, "card_out_width").GetInt();
     }
 
+    virtual void serialize_binary(std::ostream& os) const override;
+
+    virtual std::string sparsity_report() const override
+    {
+        std::string r;
+        int i = 0;
+        for_each_layer([&](const Layer& x) {
+            auto [nonzero, total] = SparseCoefs::count_blocks(x.coefs());
+            auto c = x.coefs().flat();
+            auto zeros = std::count(c.begin(), c.end(), 0.0f);
+            const bool sparse = nonzero <= SparseCoefs::max_density * total;
+            r += fmt::format("layer {:2} {:3}x{:<3} {:5.1f}% zero, {:5.1f}% of blocks nonzero: {}\n",
+                             i++,
+                             x.in_size(),
+                             x.out_size(),
+                             100.0 * zeros / c.size(),
+                             total ? 100.0 * nonzero / total : 0.0,
+                             sparse ? "sparse" : "dense");
+        });
+        return r;
+    }
+
     virtual std::unique_ptr<IModel> clone() const { return std::make_unique<Model>(*this); }
+    virtual std::unique_ptr<IModel> freeze() const override
+    {
+        auto m = std::make_unique<Model>(*this);
+        m->freeze_in_place();
+        return m;
+    }
 };
 
 std::unique_ptr<IModel> make_model(const ModelDims& dims, const std::string& s)
@@ -1145,17 +2522,301 @@ std::unique_ptr<IModel> make_model(const ModelDims& dims, const std::string& s)
     return m;
 }
 
-std::unique_ptr<IModel> load_model(const std::string& s)
+// Binary model file layout. Offsets are from the start of the file and 64-byte aligned, so a mapped file can be
+// used in place; numbers are stored in the writer's byte order, which byte_order records.
+struct model_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // JSON: {"dims": ModelDims, "model": Model::serialize() without layer data}
+    uint64_t meta_offset;
+    uint64_t meta_size;
+    // float[coefs_count]: Model::m_coefs_arena
+    uint64_t coefs_offset;
+    uint64_t coefs_count;
+    // float[3 * coefs_count]: Model::m_state_arena, or 0 when the model was frozen
+    uint64_t state_offset;
+    uint64_t file_size;
+    // Of every byte from meta_offset to file_size
+    uint64_t checksum;
+};
+
+static constexpr char model_file_magic[8] = {'M', 'L', 'C', 'M', 'O', 'D', 'E', 'L'};
+static constexpr uint32_t model_file_version = 1;
+static constexpr uint32_t model_file_byte_order = 0x01020304;
+static constexpr size_t model_file_alignment = 64;
+
+static size_t align_file_offset(size_t n) { return (n + model_file_alignment - 1) & ~(model_file_alignment - 1); }
+
+// FNV-1a over 64-bit words; every checksummed section is a multiple of 8 bytes long.
+static uint64_t checksum_words(uint64_t h, const char* p, size_t n)
+{
+    for (size_t i = 0; i < n; i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+    }
+    return h;
+}
+static constexpr uint64_t checksum_seed = 14695981039346656037ull;
+
+static void serialize(const ModelDims& d, RJWriter& w)
+{
+    w.StartObject();
+    w.Key("type");
+    w.String(d.type.c_str());
+    w.Key("dims");
+    w.StartArray();
+    for (auto x : d.dims)
+        w.Int(x);
+    w.EndArray();
+    w.Key("children");
+    w.StartObject();
+    for (auto& [k, c] : d.children)
+    {
+        w.Key(k.c_str());
+        serialize(c, w);
+    }
+    w.EndObject();
+    w.EndObject();
+}
+
+void Model::serialize_binary(std::ostream& os) const
+{
+    rapidjson::StringBuffer sb;
+    RJWriter w(sb);
+    w.omit_layer_data = true;
+    w.StartObject();
+    w.Key("dims");
+    ::serialize(*dims(), w);
+    w.Key("model");
+    serialize(w);
+    w.EndObject();
+
+    // Sections are zero padded to the alignment, which also keeps them a whole number of checksum words.
+    std::string meta(sb.GetString(), sb.GetSize());
+    meta.resize(align_file_offset(meta.size()), '\0');
+    const char* coefs = reinterpret_cast<const char*>(m_coefs_arena.data);
+    const char* state = reinterpret_cast<const char*>(m_state_arena.data);
+    const size_t coefs_bytes = m_coefs_arena.size * sizeof(float);
+    const size_t state_bytes = m_state_arena.size * sizeof(float);
+
+    model_file_header h = {};
+    std::memcpy(h.magic, model_file_magic, sizeof(h.magic));
+    h.version = model_file_version;
+    h.byte_order = model_file_byte_order;
+    h.meta_offset = align_file_offset(sizeof(h));
+    h.meta_size = sb.GetSize();
+    h.coefs_offset = h.meta_offset + meta.size();
+    h.coefs_count = m_coefs_arena.size;
+    h.state_offset = m_state_arena ? h.coefs_offset + coefs_bytes : 0;
+    h.file_size = h.coefs_offset + coefs_bytes + state_bytes;
+    h.checksum = checksum_words(checksum_seed, meta.data(), meta.size());
+    h.checksum = checksum_words(h.checksum, coefs, coefs_bytes);
+    h.checksum = checksum_words(h.checksum, state, state_bytes);
+
+    std::string header(reinterpret_cast<const char*>(&h), sizeof(h));
+    header.resize(h.meta_offset, '\0');
+    os.write(header.data(), header.size());
+    os.write(meta.data(), meta.size());
+    os.write(coefs, coefs_bytes);
+    if (state_bytes) os.write(state, state_bytes);
+    if (!os) throw std::runtime_error("failed to write model file");
+}
+
+static bool is_binary_model(const char* data, size_t size)
+{
+    return size >= sizeof(model_file_header) && std::memcmp(data, model_file_magic, sizeof(model_file_magic)) == 0;
+}
+
+// The parameter blocks are used in place, shared with every other model loaded from the same mapping; they are
+// copied only when the model first writes them.
+static std::unique_ptr<IModel> load_model_binary(std::shared_ptr<const mapped_file> f, bool inference_only)
+{
+    model_file_header h;
+    std::memcpy(&h, f->data(), sizeof(h));
+    if (h.version != model_file_version) throw std::runtime_error("unsupported model file version");
+    if (h.byte_order != model_file_byte_order) throw std::runtime_error("model file has a different byte order");
+    // Each bound is checked before it is subtracted from, so none of these can wrap around.
+    if (h.file_size != f->size() || h.meta_offset < sizeof(h) || h.meta_offset > h.file_size ||
+        (h.file_size - h.meta_offset) % 8 != 0 || h.coefs_offset < h.meta_offset || h.coefs_offset > h.file_size ||
+        h.meta_size > h.coefs_offset - h.meta_offset || h.coefs_offset % model_file_alignment != 0 ||
+        h.coefs_count > (h.file_size - h.coefs_offset) / (sizeof(float) * (h.state_offset ? 4 : 1)))
+        throw std::runtime_error("model file is truncated or malformed");
+    // The optimizer state, if any, directly follows the coefficients.
+    if (h.state_offset != 0 && h.state_offset != h.coefs_offset + h.coefs_count * sizeof(float))
+        throw std::runtime_error("model file is truncated or malformed");
+    if (checksum_words(checksum_seed, f->data() + h.meta_offset, h.file_size - h.meta_offset) != h.checksum)
+        throw std::runtime_error("model file checksum mismatch");
+
+    rapidjson::Document doc;
+    doc.Parse(f->data() + h.meta_offset, h.meta_size);
+    if (doc.HasParseError()) throw std::runtime_error("model file metadata is not valid JSON");
+    auto& v = find_or_throw(doc, "model");
+    auto it_id = v.FindMember("id");
+    auto m = std::make_unique<Model>(find_or_throw(v, "name").GetString(),
+                                     it_id == v.MemberEnd() ? 0 : it_id->value.GetInt());
+    m->deserialize_structure(v, {});
+    if (m->arena_size() != h.coefs_count) throw std::runtime_error("model file parameters do not match its layers");
+
+    auto block = [&](uint64_t offset, size_t count) {
+        ParamArena a;
+        a.data = reinterpret_cast<float*>(const_cast<char*>(f->data() + offset));
+        a.size = count;
+        a.owner = f;
+        a.read_only = true;
+        return a;
+    };
+    m->adopt_params(block(h.coefs_offset, h.coefs_count),
+                    h.state_offset && !inference_only ? block(h.state_offset, 3 * h.coefs_count) : ParamArena{});
+    return m;
+}
+
+// SAX handler building the model document, except that each Layer's "data" array of numbers is only counted and set
+// aside in `arrays` as a span of the source text, and the document gets its index instead. Layer data is nearly all
+// of a model file, so this avoids a DOM node per parameter, and the numbers are converted once, straight into the
+// Model's arena, when Layer::bind reads them. Numbers arrive as text (kParseNumbersAsStringsFlag), so skipping a
+// layer's numbers here costs no conversion.
+struct model_json_handler
+{
+    rapidjson::Document& doc;
+    std::vector<LayerDataText>& arrays;
+    // The source and the reader's position in it, for recording where layer data arrays start and end.
+    const char* src;
+    const rapidjson::MemoryStream& is;
+    size_t array_begin = 0;
+
+    enum
+    {
+        normal,
+        // After the key "data"; an array here may be layer data.
+        data_key,
+        // Inside an array after "data" before its first element, which decides whether it is layer data.
+        data_array,
+        // Counting numbers into arrays.back().
+        layer_data,
+    } state = normal;
+
+    // Anything but a number in data_array: it was an ordinary array after all.
+    bool open_array()
+    {
+        if (state == layer_data) return false;
+        if (state == data_array && !doc.StartArray()) return false;
+        state = normal;
+        return true;
+    }
+
+    bool Null() { return open_array() && doc.Null(); }
+    bool Bool(bool b) { return open_array() && doc.Bool(b); }
+    bool Int(int x) { return open_array() && doc.Int(x); }
+    bool Uint(unsigned x) { return open_array() && doc.Uint(x); }
+    bool Int64(int64_t x) { return open_array() && doc.Int64(x); }
+    bool Uint64(uint64_t x) { return open_array() && doc.Uint64(x); }
+    bool Double(double x) { return open_array() && doc.Double(x); }
+    bool String(const char* s, rapidjson::SizeType n, bool copy) { return open_array() && doc.String(s, n, copy); }
+    bool StartObject() { return open_array() && doc.StartObject(); }
+    bool EndObject(rapidjson::SizeType n) { return open_array() && doc.EndObject(n); }
+
+    bool Key(const char* s, rapidjson::SizeType n, bool copy)
+    {
+        if (!open_array()) return false;
+        if (n == 4 && std::memcmp(s, "data", 4) == 0) state = data_key;
+        return doc.Key(s, n, copy);
+    }
+
+    bool StartArray()
+    {
+        if (state == data_key)
+        {
+            state = data_array;
+            array_begin = is.Tell();
+            return true;
+        }
+        return open_array() && doc.StartArray();
+    }
+
+    bool EndArray(rapidjson::SizeType n)
+    {
+        if (state == layer_data)
+        {
+            state = normal;
+            // The reader has just taken the closing bracket.
+            arrays.back().text = std::string_view(src + array_begin, is.Tell() - 1 - array_begin);
+            return doc.Uint((unsigned)(arrays.size() - 1));
+        }
+        return open_array() && doc.EndArray(n);
+    }
+
+    bool RawNumber(const char* s, rapidjson::SizeType n, bool /*copy*/)
+    {
+        if (state == data_array)
+        {
+            arrays.emplace_back();
+            state = layer_data;
+        }
+        if (state == layer_data)
+        {
+            ++arrays.back().count;
+            return true;
+        }
+        state = normal;
+        const char* end = s + n;
+        if (std::find_first_of(s, end, ".eE", ".eE" + 3) == end)
+        {
+            int64_t i = 0;
+            if (std::from_chars(s, end, i).ptr == end) return i < 0 ? doc.Int64(i) : doc.Uint64((uint64_t)i);
+        }
+        double d = 0;
+        if (std::from_chars(s, end, d).ptr != end) return false;
+        return doc.Double(d);
+    }
+};
+
+static std::unique_ptr<IModel> load_model_json(const char* s, size_t n, bool inference_only)
 {
+    std::vector<LayerDataText> arrays;
     rapidjson::Document doc;
-    doc.Parse(s.c_str(), s.size());
+    rapidjson::ParseResult ok;
+    auto generate = [&](rapidjson::Document& d) {
+        rapidjson::MemoryStream is(s, n);
+        model_json_handler h{d, arrays, s, is};
+        rapidjson::Reader r;
+        ok = r.Parse<rapidjson::kParseNumbersAsStringsFlag>(is, h);
+        return !ok.IsError();
+    };
+    doc.Populate(generate);
+    if (ok.IsError()) throw std::runtime_error(fmt::format("model is not valid JSON (offset {})", ok.Offset()));
+
     auto it_id = doc.FindMember("id");
     auto m = std::make_unique<Model>(find_or_throw(doc, "name").GetString(),
                                      it_id == doc.MemberEnd() ? 0 : it_id->value.GetInt());
-    m->deserialize(doc);
+    m->deserialize(doc, arrays, inference_only);
     return m;
 }
 
+std::unique_ptr<IModel> load_model_file(const std::filesystem::path& path, bool inference_only)
+{
+    auto f = mapped_file::open(path);
+    if (!f) throw std::runtime_error("could not open " + path.u8string());
+    if (is_binary_model(f->data(), f->size())) return load_model_binary(std::move(f), inference_only);
+    return load_model_json(f->data(), f->size(), inference_only);
+}
+
+std::unique_ptr<IModel> load_model(const std::string& s, bool inference_only)
+{
+    return load_model_json(s.data(), s.size(), inference_only);
+}
+
+void save_model(const IModel& m, std::ostream& os)
+{
+    rapidjson::StringBuffer sb;
+    RJWriter w(sb, os);
+    m.serialize(w);
+    w.drain();
+}
+
 const ModelDims& default_model_dims()
 {
     static ModelDims md{{
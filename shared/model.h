@@ -1,5 +1,8 @@
 #pragma once
 
+#include "span.h"
+#include <filesystem>
+#include <iosfwd>
 #include <memory>
 #include <string>
 
@@ -24,15 +27,32 @@ struct IModel
     IModel(std::string&& name, int i = 0) : m_name(std::move(name)), id(i) { }
     virtual ~IModel() { }
 
-    virtual std::unique_ptr<IEval> make_eval() = 0;
-    virtual void calc(IEval& e, Encoded& input, bool full) = 0;
+    // The const members only read the model. Any number of threads may make evals and calc on one model at once, each
+    // with its own IEval; nothing that changes the model (backprop_init, backprop, learn, normalize) may run meanwhile.
+    virtual std::unique_ptr<IEval> make_eval() const = 0;
+    virtual void calc(IEval& e, const Encoded& input, bool full) const = 0;
+    // Equivalent to calc(*evals[i], inputs[i], full) for every i, but lets a model share work across the batch.
+    virtual void calc_batch(span<const Encoded> inputs, span<IEval*> evals, bool full) const;
+    // Equivalent to calc(e, input, false) then calc(e_full, input, true), computing what the two share only once.
+    virtual void calc_both(IEval& e, IEval& e_full, const Encoded& input) const;
     virtual void backprop(IEval& e, Encoded& input, vec_slice grad, bool full) = 0;
+    // Equivalent to backprop(*evals[i], *inputs[i], grads[i], full) for every i in order, with each layer's weight
+    // gradients accumulated for the whole batch at once.
+    virtual void backprop_batch(span<Encoded*> inputs, span<IEval*> evals, span<vec_slice> grads, bool full);
     virtual void backprop_init() = 0;
     virtual void learn(float learn_rate) = 0;
     virtual void normalize(float learn_rate) = 0;
 
     virtual std::unique_ptr<IModel> clone() const = 0;
+    // Copy holding only what calc needs; the optimizer state is dropped, cutting memory roughly 4x. A frozen model
+    // only supports calc, serialize and further clones until backprop_init() gives it fresh optimizer state.
+    virtual std::unique_ptr<IModel> freeze() const = 0;
     virtual void serialize(RJWriter& w) const = 0;
+    // Binary model file: the structure as JSON followed by the raw, aligned parameter blocks, with a checksum. Much
+    // smaller and faster to load than serialize(); load it with load_model_file. Throws if writing to os fails.
+    virtual void serialize_binary(std::ostream& os) const = 0;
+    // One line per layer: how many coefficients are zero, and whether frozen copies use the sparse kernel for it.
+    virtual std::string sparsity_report() const = 0;
     virtual std::unique_ptr<ModelDims> dims() const = 0;
 
     void increment_name() { ++id; }
@@ -51,4 +71,10 @@ const ModelDims& medium_model_dims();
 const ModelDims& small_model_dims();
 
 std::unique_ptr<IModel> make_model(const ModelDims& dims, const std::string& s);
-std::unique_ptr<IModel> load_model(const std::string& s);
+// With inference_only set, the loaded model is already frozen.
+std::unique_ptr<IModel> load_model(const std::string& s, bool inference_only = false);
+// Writes m as JSON, streaming it to os a layer at a time instead of building the whole document in memory first.
+void save_model(const IModel& m, std::ostream& os);
+// Loads either a JSON or a binary model file. Binary files are memory mapped and their parameters used in place until
+// the model first writes them, so processes loading the same file share its pages.
+std::unique_ptr<IModel> load_model_file(const std::filesystem::path& path, bool inference_only = false);
@@ -0,0 +1,106 @@
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::atomic<unsigned> s_max_threads = 0;
+
+void parallel_pool::set_max_threads(unsigned n) { s_max_threads = n; }
+
+unsigned parallel_pool::max_threads()
+{
+    // hardware_concurrency() can be a syscall, and this is asked on every layer call.
+    static const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    auto n = s_max_threads.load();
+    return n ? n : hardware;
+}
+
+struct pool_job
+{
+    parallel_pool::block_fn fn;
+    void* ctx;
+    size_t n;
+    size_t blocks;
+    std::atomic<size_t> next = 0;
+    // Pool threads currently working on this job; guarded by pool_state::m.
+    int helpers = 0;
+
+    void drain()
+    {
+        for (size_t i; (i = next++) < blocks;)
+            fn(ctx, n * i / blocks, n * (i + 1) / blocks);
+    }
+};
+
+struct pool_state
+{
+    std::mutex m;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::deque<pool_job*> jobs;
+    std::vector<std::thread> threads;
+
+    // Callers never wait on each other: a job stays queued until its caller has taken its own share, and idle
+    // threads join whichever job is at the front.
+    void ensure_threads(size_t n)
+    {
+        while (threads.size() < n)
+            threads.emplace_back([this] { loop(); });
+    }
+
+    void remove(pool_job* j)
+    {
+        auto it = std::find(jobs.begin(), jobs.end(), j);
+        if (it != jobs.end()) jobs.erase(it);
+    }
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        for (;;)
+        {
+            work_cv.wait(lk, [this] { return !jobs.empty(); });
+            auto j = jobs.front();
+            ++j->helpers;
+            lk.unlock();
+            j->drain();
+            lk.lock();
+            remove(j);
+            if (--j->helpers == 0) done_cv.notify_all();
+        }
+    }
+};
+
+// Intentionally leaked: pool threads run for the life of the process and must not be joined during static
+// destruction while other threads may still be calling into it.
+static pool_state& get_pool()
+{
+    static pool_state* p = new pool_state;
+    return *p;
+}
+
+void parallel_pool::run(size_t n, size_t blocks, block_fn fn, void* ctx)
+{
+    auto& p = get_pool();
+    pool_job j;
+    j.fn = fn;
+    j.ctx = ctx;
+    j.n = n;
+    j.blocks = blocks;
+    {
+        std::lock_guard<std::mutex> lk(p.m);
+        p.ensure_threads(max_threads() - 1);
+        p.jobs.push_back(&j);
+    }
+    p.work_cv.notify_all();
+
+    j.drain();
+
+    std::unique_lock<std::mutex> lk(p.m);
+    p.remove(&j);
+    p.done_cv.wait(lk, [&] { return j.helpers == 0; });
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+
+/// <summary>
+/// Process-wide thread pool used to split a single large layer kernel across cores. Calls whose total work is below
+/// work_threshold multiply-adds never reach the pool and run inline on the calling thread, so small models keep their
+/// single-threaded behaviour and no pool threads are started for them.
+/// </summary>
+struct parallel_pool
+{
+    static constexpr size_t work_threshold = 64 * 1024;
+
+    /// <summary>
+    /// Number of threads, including the caller, one call may use. 1 disables the pool; 0 (the default) uses
+    /// std::thread::hardware_concurrency(), read once on first use.
+    /// </summary>
+    static void set_max_threads(unsigned n);
+    static unsigned max_threads();
+
+    using block_fn = void (*)(void* ctx, size_t begin, size_t end);
+
+    /// <summary>
+    /// Split [0, n) into `blocks` contiguous ranges and call fn on each, using pool threads alongside the caller.
+    /// Returns once every range has finished.
+    /// </summary>
+    static void run(size_t n, size_t blocks, block_fn fn, void* ctx);
+};
+
+/// <summary>
+/// Call f(begin, end) over disjoint ranges covering [0, n), where each item costs roughly work_per_item multiply-adds.
+/// Large enough loops are spread over parallel_pool; everything else is a single f(0, n) on this thread.
+/// </summary>
+template<class F>
+void parallel_for(size_t n, size_t work_per_item, F&& f)
+{
+    const size_t threads = parallel_pool::max_threads();
+    const size_t work = n * work_per_item;
+    if (threads <= 1 || n < 2 || work < parallel_pool::work_threshold)
+    {
+        f(size_t(0), n);
+        return;
+    }
+    // Keep every block at least a quarter of the threshold so the hand-off stays cheap relative to the work.
+    const size_t blocks = std::min({n, threads * 2, work / (parallel_pool::work_threshold / 4)});
+    using Fn = std::remove_reference_t<F>;
+    parallel_pool::run(
+        n, blocks, [](void* ctx, size_t begin, size_t end) { (*static_cast<Fn*>(ctx))(begin, end); }, &f);
+}
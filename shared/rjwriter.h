@@ -1,8 +1,28 @@
 #pragma once
 
+#include <ostream>
+#include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
 struct RJWriter : rapidjson::Writer<rapidjson::StringBuffer>
 {
     using rapidjson::Writer<rapidjson::StringBuffer>::Writer;
+    // Streams to os: each drain() writes out and clears what sb holds so far.
+    RJWriter(rapidjson::StringBuffer& sb, std::ostream& os) : Writer(sb), m_sb(&sb), m_sink(&os) { }
+
+    // Set while writing the structure of a binary model file: layers then leave out their data, which the file stores
+    // as raw parameter blocks instead.
+    bool omit_layer_data = false;
+
+    // Safe between any two values; does nothing without a stream.
+    void drain()
+    {
+        if (!m_sink) return;
+        m_sink->write(m_sb->GetString(), m_sb->GetSize());
+        m_sb->Clear();
+    }
+
+private:
+    rapidjson::StringBuffer* m_sb = nullptr;
+    std::ostream* m_sink = nullptr;
 };
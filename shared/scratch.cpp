@@ -0,0 +1,72 @@
+#include "scratch.h"
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+static constexpr size_t align_floats = scratch_arena::alignment / sizeof(float);
+static std::atomic<size_t> s_global_high_water = 0;
+
+static size_t round_up(size_t n) { return (n + align_floats - 1) / align_floats * align_floats; }
+
+scratch_arena& scratch_arena::local()
+{
+    thread_local scratch_arena arena;
+    return arena;
+}
+
+size_t scratch_arena::global_high_water() { return s_global_high_water.load() * sizeof(float); }
+
+void scratch_arena::block_deleter::operator()(float* p) const
+{
+    ::operator delete(p, std::align_val_t(scratch_arena::alignment));
+}
+
+scratch_arena::block scratch_arena::make_block(size_t n)
+{
+    block b;
+    b.size = std::max(round_up(n), block_floats);
+    b.data.reset(static_cast<float*>(::operator new(b.size * sizeof(float), std::align_val_t(alignment))));
+    return b;
+}
+
+float* scratch_arena::alloc(size_t n)
+{
+    n = round_up(n);
+    if (m_used == 0 && m_pending_reserve != 0) reserve(m_pending_reserve);
+    if (m_blocks.empty()) m_blocks.push_back(make_block(n));
+    while (m_offset + n > m_blocks[m_block].size)
+    {
+        // Later blocks are kept for reuse; only grow when the next one is missing or too small.
+        ++m_block;
+        m_offset = 0;
+        if (m_block == m_blocks.size() || m_blocks[m_block].size < n)
+            m_blocks.insert(m_blocks.begin() + m_block, make_block(n));
+    }
+    auto p = m_blocks[m_block].data.get() + m_offset;
+    m_offset += n;
+    m_used += n;
+    if (m_used > m_high_water)
+    {
+        m_high_water = m_used;
+        auto g = s_global_high_water.load();
+        while (g < m_used && !s_global_high_water.compare_exchange_weak(g, m_used))
+        {
+        }
+    }
+    return p;
+}
+
+void scratch_arena::reserve(size_t n)
+{
+    // Live allocations pin the current blocks; remember the hint until the arena is empty again.
+    if (m_used != 0)
+    {
+        m_pending_reserve = std::max(m_pending_reserve, n);
+        return;
+    }
+    m_pending_reserve = 0;
+    if (!m_blocks.empty() && m_blocks[0].size >= n) return;
+    m_blocks.insert(m_blocks.begin(), make_block(n));
+    m_block = 0;
+    m_offset = 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+/// <summary>
+/// Per-thread bump allocator for short-lived float temporaries. Storage is handed out in 64-byte aligned chunks from
+/// blocks that are never moved, and is released in LIFO order by scratch_mark.
+/// </summary>
+struct scratch_arena
+{
+    static constexpr size_t alignment = 64;
+    static constexpr size_t block_floats = 16 * 1024;
+
+    /// <summary>
+    /// The calling thread's arena.
+    /// </summary>
+    static scratch_arena& local();
+
+    /// <summary>
+    /// Largest number of bytes simultaneously in use by any thread's arena.
+    /// </summary>
+    static size_t global_high_water();
+
+    float* alloc(size_t n);
+
+    /// <summary>
+    /// Ensure at least n floats are available without allocating a new block. While allocations are live the request
+    /// is deferred to the next allocation made from an empty arena.
+    /// </summary>
+    void reserve(size_t n);
+
+    size_t used() const { return m_used * sizeof(float); }
+    size_t high_water() const { return m_high_water * sizeof(float); }
+
+private:
+    friend struct scratch_mark;
+
+    struct block_deleter
+    {
+        void operator()(float* p) const;
+    };
+    struct block
+    {
+        std::unique_ptr<float[], block_deleter> data;
+        size_t size = 0;
+    };
+
+    block make_block(size_t n);
+
+    std::vector<block> m_blocks;
+    size_t m_block = 0;
+    size_t m_offset = 0;
+    size_t m_used = 0;
+    size_t m_high_water = 0;
+    size_t m_pending_reserve = 0;
+};
+
+/// <summary>
+/// Releases everything allocated from the current thread's scratch_arena during this object's lifetime.
+/// </summary>
+struct scratch_mark
+{
+    scratch_mark() : m_arena(scratch_arena::local())
+    {
+        m_block = m_arena.m_block;
+        m_offset = m_arena.m_offset;
+        m_used = m_arena.m_used;
+    }
+    scratch_mark(const scratch_mark&) = delete;
+    scratch_mark& operator=(const scratch_mark&) = delete;
+    ~scratch_mark()
+    {
+        m_arena.m_block = m_block;
+        m_arena.m_offset = m_offset;
+        m_arena.m_used = m_used;
+    }
+
+private:
+    scratch_arena& m_arena;
+    size_t m_block;
+    size_t m_offset;
+    size_t m_used;
+};
+
+#define VEC_SCRATCH_VEC(X, SZ)                                                                                         \
+    auto X##_size = (SZ);                                                                                              \
+    scratch_mark X##_mark;                                                                                             \
+    vec_slice X(scratch_arena::local().alloc(X##_size), X##_size)
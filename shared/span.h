@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Non-owning view of a contiguous array; stands in for std::span until the project moves past C++17.
+template<class T>
+struct span
+{
+    constexpr span() = default;
+    constexpr span(T* data, size_t size) : m_data(data), m_size(size) { }
+    template<class U>
+    span(std::vector<U>& v) : m_data(v.data()), m_size(v.size())
+    {
+    }
+    template<size_t N>
+    constexpr span(T (&data)[N]) : m_data(data), m_size(N)
+    {
+    }
+
+    constexpr T* data() const { return m_data; }
+    constexpr size_t size() const { return m_size; }
+    constexpr bool empty() const { return m_size == 0; }
+
+    T& operator[](size_t i) const { return m_data[i]; }
+
+    T* begin() const { return m_data; }
+    T* end() const { return m_data + m_size; }
+
+    span subspan(size_t offset, size_t len) const { return {m_data + offset, len}; }
+
+private:
+    T* m_data = nullptr;
+    size_t m_size = 0;
+};
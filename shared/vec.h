@@ -1,6 +1,11 @@
 #pragma once
 
+#include "span.h"
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <valarray>
 
 #if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
@@ -23,14 +28,6 @@
 #define VEC_CHECK_BOUNDS1(X)
 #endif
 
-#if !defined(_WIN32)
-#define _alloca alloca
-#endif
-#define VEC_STACK_VEC(X, SZ)                                                                                           \
-    auto X##_size = (SZ);                                                                                              \
-    float* X##_storage = (float*)_alloca(sizeof(float) * X##_size);                                                    \
-    vec_slice X(X##_storage, X##_size)
-
 struct mat_slice;
 
 #define VEC_EOP(RHS)                                                                                                   \
@@ -38,6 +35,41 @@ struct mat_slice;
         (*this)[i] RHS;                                                                                                \
     return self()
 
+/// <summary>
+/// Read-only view of contiguous floats, for inputs that a function must not write through, such as the encoded game
+/// state a model reads. Every vec_slice and vec converts to one.
+/// </summary>
+struct cvec_slice
+{
+    constexpr cvec_slice() = default;
+    constexpr cvec_slice(const float* data, size_t len) : m_data(data), m_len(len) { }
+    template<size_t Sz>
+    constexpr cvec_slice(const float (&data)[Sz]) : m_data(data), m_len(Sz)
+    {
+    }
+    cvec_slice(const std::valarray<float>& v) : m_data(&v[0]), m_len(v.size()) { }
+
+    constexpr size_t size() const { return m_len; }
+    constexpr const float* data() const { return m_data; }
+    const float* begin() const { return m_data; }
+    const float* end() const { return m_data + m_len; }
+
+    const float& operator[](size_t i) const
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (i >= m_len) std::terminate();
+#endif
+        return m_data[i];
+    }
+
+    cvec_slice slice(size_t offset) const { return {m_data + offset, m_len - offset}; }
+    cvec_slice slice(size_t offset, size_t len) const { return {m_data + offset, len}; }
+
+private:
+    const float* m_data = nullptr;
+    size_t m_len = 0;
+};
+
 struct vec_slice_base
 {
     constexpr vec_slice_base() = default;
@@ -58,6 +90,8 @@ struct vec_slice_base
         return m_data[i];
     }
 
+    constexpr operator cvec_slice() const { return {m_data, m_len}; }
+
 protected:
     float* m_data = nullptr;
     size_t m_len = 0;
@@ -89,6 +123,47 @@ protected:
 
 struct vec_stride_slice_base;
 
+/// <summary>
+/// Lazily evaluated elementwise expression over slices, built with + - * / (e.g. a - b, a * s + c). Nothing is
+/// computed until the expression is assigned into a slice or reduced, so a chain of operations runs as one loop
+/// without temporaries.
+/// </summary>
+template<class E>
+struct vec_expr
+{
+    const E& self() const { return static_cast<const E&>(*this); }
+
+    /// <summary>
+    /// e[0] + e[1] + ...
+    /// </summary>
+    float sum() const
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < self().size(); ++i)
+        {
+            sum += self()[i];
+        }
+        return sum;
+    }
+
+    /// <summary>
+    /// e[0]*o[0] + e[1]*o[1] + ...
+    /// </summary>
+    template<class V>
+    float dot(const V& o) const
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (o.size() != self().size()) std::terminate();
+#endif
+        float sum = 0.0f;
+        for (size_t i = 0; i < self().size(); ++i)
+        {
+            sum += self()[i] * o[i];
+        }
+        return sum;
+    }
+};
+
 template<class Derived, class Base>
 struct vec_ops_mixin : Base
 {
@@ -127,7 +202,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = o[i]
     /// </summary>
-    Derived& assign(vec_slice_base o)
+    Derived& assign(cvec_slice o)
     {
         VEC_CHECK_BOUNDS(o);
         VEC_EOP(= o[i]);
@@ -136,11 +211,21 @@ struct vec_ops_mixin : Base
     /// this[i] = d
     /// </summary>
     Derived& assign(float d) { VEC_EOP(= d); }
+    /// <summary>
+    /// this[i] = e[i], evaluating the whole expression in a single pass
+    /// </summary>
+    template<class E>
+    Derived& assign(const vec_expr<E>& e)
+    {
+        auto& x = e.self();
+        VEC_CHECK_BOUNDS(x);
+        VEC_EOP(= x[i]);
+    }
 
     /// <summary>
     /// this[i] = a[i] * b[i]
     /// </summary>
-    Derived& assign_mult(vec_slice_base a, vec_slice_base b)
+    Derived& assign_mult(cvec_slice a, cvec_slice b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_CHECK_BOUNDS(b);
@@ -150,7 +235,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = a[i] * b
     /// </summary>
-    Derived& assign_mult(vec_slice_base a, float b)
+    Derived& assign_mult(cvec_slice a, float b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_EOP(= a[i] * b);
@@ -159,7 +244,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = a[i] + b[i]
     /// </summary>
-    Derived& assign_add(vec_slice_base a, vec_slice_base b)
+    Derived& assign_add(cvec_slice a, cvec_slice b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_CHECK_BOUNDS(b);
@@ -169,7 +254,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = a[i] + b
     /// </summary>
-    Derived& assign_add(vec_slice_base a, float b)
+    Derived& assign_add(cvec_slice a, float b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_EOP(= a[i] + b);
@@ -178,7 +263,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = a[i] - b[i]
     /// </summary>
-    Derived& assign_sub(vec_slice_base a, vec_slice_base b)
+    Derived& assign_sub(cvec_slice a, cvec_slice b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_CHECK_BOUNDS(b);
@@ -187,7 +272,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = a - b[i]
     /// </summary>
-    Derived& assign_sub(float a, vec_slice_base b)
+    Derived& assign_sub(float a, cvec_slice b)
     {
         VEC_CHECK_BOUNDS(b);
         VEC_EOP(= a - b[i]);
@@ -211,10 +296,55 @@ struct vec_ops_mixin : Base
         VEC_EOP(= m.row(i).dot(v));
     }
 
+    /// <summary>
+    /// this[i] = (v... 1) dot M[:, offset + i], walking M one contiguous row at a time. Accumulates in the same order
+    /// as assign_mv1_mult(M.transpose(), v).
+    /// </summary>
+    template<class Mat, class Vec>
+    Derived& assign_vm1_mult(Mat m, Vec v, size_t offset = 0)
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (v.size() + 1 != m.rows() || offset + this->size() > m.cols()) std::terminate();
+#endif
+        assign(m.last_row().slice(offset, this->size()));
+        size_t j = 0;
+        // Four rows per pass so each output element is loaded and stored once per block.
+        for (; j + 4 <= v.size(); j += 4)
+        {
+            const float* r0 = m.row(j).data() + offset;
+            const float* r1 = m.row(j + 1).data() + offset;
+            const float* r2 = m.row(j + 2).data() + offset;
+            const float* r3 = m.row(j + 3).data() + offset;
+            const float v0 = v[j], v1 = v[j + 1], v2 = v[j + 2], v3 = v[j + 3];
+            for (size_t i = 0; i < this->size(); ++i)
+                (*this)[i] = (*this)[i] + r0[i] * v0 + r1[i] * v1 + r2[i] * v2 + r3[i] * v3;
+        }
+        for (; j < v.size(); ++j)
+            fma(m.row(j).slice(offset, this->size()), v[j]);
+        return self();
+    }
+
+    /// <summary>
+    /// this = (v... 1) * M, only visiting the rows of M where v[j] != 0
+    /// </summary>
+    template<class Mat, class Vec>
+    Derived& assign_sparse_vm1_mult(Mat m, Vec v)
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (v.size() + 1 != m.rows()) std::terminate();
+#endif
+        assign(m.last_row());
+        for (size_t j = 0; j < v.size(); ++j)
+        {
+            if (v[j] != 0.0f) fma(m.row(j), v[j]);
+        }
+        return self();
+    }
+
     /// <summary>
     /// this[i] += a[i] * b[i]
     /// </summary>
-    Derived& fma(vec_slice_base a, vec_slice_base b)
+    Derived& fma(cvec_slice a, cvec_slice b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_CHECK_BOUNDS(b);
@@ -223,7 +353,7 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] += a[i] * b
     /// </summary>
-    Derived& fma(vec_slice_base a, float b)
+    Derived& fma(cvec_slice a, float b)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_EOP(+= a[i] * b);
@@ -232,17 +362,40 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] += a[i]
     /// </summary>
-    Derived& add(vec_slice_base a)
+    Derived& add(cvec_slice a)
     {
         VEC_CHECK_BOUNDS(a);
         VEC_EOP(+= a[i]);
     }
+    /// <summary>
+    /// this[i] += e[i]
+    /// </summary>
+    template<class E>
+    Derived& add(const vec_expr<E>& e)
+    {
+        auto& x = e.self();
+        VEC_CHECK_BOUNDS(x);
+        VEC_EOP(+= x[i]);
+    }
 
     /// <summary>
     /// this[i] *= a
     /// </summary>
     Derived& mult(float a) { VEC_EOP(*= a); }
 
+    /// <summary>
+    /// this[0] + this[1] + ...
+    /// </summary>
+    float sum() const
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < this->size(); ++i)
+        {
+            sum += (*this)[i];
+        }
+        return sum;
+    }
+
     /// <summary>
     /// max(this[0], this[1], ...)
     /// </summary>
@@ -270,7 +423,8 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = this[i] * (1 - ratio) + x[i] * ratio
     /// </summary>
-    Derived& decay_average(vec_slice_base x, float ratio)
+    template<class V>
+    Derived& decay_average(const V& x, float ratio)
     {
         VEC_CHECK_BOUNDS(x);
         VEC_EOP(= (*this)[i] * (1 - ratio) + x[i] * ratio);
@@ -279,7 +433,8 @@ struct vec_ops_mixin : Base
     /// <summary>
     /// this[i] = this[i] * (1 - ratio) + x[i]^2 * ratio
     /// </summary>
-    Derived& decay_variance(vec_slice_base x, float ratio)
+    template<class V>
+    Derived& decay_variance(const V& x, float ratio)
     {
         VEC_CHECK_BOUNDS(x);
         VEC_EOP(= (*this)[i] * (1 - ratio) + x[i] * x[i] * ratio);
@@ -334,6 +489,82 @@ struct vec_stride_slice : vec_ops_mixin<vec_slice, vec_stride_slice_base>
 
 #undef VEC_EOP
 
+template<class T>
+struct is_vec_operand : std::is_base_of<vec_expr<T>, T>
+{
+};
+template<>
+struct is_vec_operand<vec_slice> : std::true_type
+{
+};
+template<>
+struct is_vec_operand<vec_stride_slice> : std::true_type
+{
+};
+template<>
+struct is_vec_operand<cvec_slice> : std::true_type
+{
+};
+
+template<class Op, class L, class R>
+struct vec_binary_expr : vec_expr<vec_binary_expr<Op, L, R>>
+{
+    vec_binary_expr(L l, R r) : l(l), r(r)
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if constexpr (!std::is_same_v<L, float> && !std::is_same_v<R, float>)
+        {
+            if (l.size() != r.size()) std::terminate();
+        }
+#endif
+    }
+
+    size_t size() const
+    {
+        if constexpr (std::is_same_v<L, float>)
+            return r.size();
+        else
+            return l.size();
+    }
+
+    float operator[](size_t i) const { return Op()(at(l, i), at(r, i)); }
+
+private:
+    static float at(float x, size_t) { return x; }
+    template<class V>
+    static float at(const V& x, size_t i)
+    {
+        return x[i];
+    }
+
+    L l;
+    R r;
+};
+
+#define VEC_EXPR_OPERATOR(OP, FN)                                                                                      \
+    template<class L, class R, std::enable_if_t<is_vec_operand<L>::value && is_vec_operand<R>::value, int> = 0>        \
+    vec_binary_expr<FN, L, R> operator OP(L l, R r)                                                                    \
+    {                                                                                                                  \
+        return {l, r};                                                                                                 \
+    }                                                                                                                  \
+    template<class L, std::enable_if_t<is_vec_operand<L>::value, int> = 0>                                             \
+    vec_binary_expr<FN, L, float> operator OP(L l, float r)                                                            \
+    {                                                                                                                  \
+        return {l, r};                                                                                                 \
+    }                                                                                                                  \
+    template<class R, std::enable_if_t<is_vec_operand<R>::value, int> = 0>                                             \
+    vec_binary_expr<FN, float, R> operator OP(float l, R r)                                                            \
+    {                                                                                                                  \
+        return {l, r};                                                                                                 \
+    }
+
+VEC_EXPR_OPERATOR(+, std::plus<float>)
+VEC_EXPR_OPERATOR(-, std::minus<float>)
+VEC_EXPR_OPERATOR(*, std::multiplies<float>)
+VEC_EXPR_OPERATOR(/, std::divides<float>)
+
+#undef VEC_EXPR_OPERATOR
+
 struct mat_slice_base
 {
     constexpr mat_slice_base() = default;
@@ -424,6 +655,115 @@ struct mat_slice : row_major_mat_slice_base
         return {m_data + offset * m_cols, len, m_cols};
     }
     inline transposed_mat_slice transpose() const;
+
+    /// <summary>
+    /// this += a^T g, i.e. this[j] += a[j] * g. Rows where a[j] == 0 are not touched.
+    /// </summary>
+    void add_outer(cvec_slice a, cvec_slice g) const
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (a.size() != m_rows || g.size() != m_cols) std::terminate();
+#endif
+        // Gather non-zero rows four at a time so each g[c] is loaded once per block.
+        size_t block[4];
+        size_t n = 0;
+        for (size_t j = 0; j < a.size(); ++j)
+        {
+            if (a[j] == 0.0f) continue;
+            block[n++] = j;
+            if (n == 4)
+            {
+                add_outer_rows4(block, a.data(), g.data());
+                n = 0;
+            }
+        }
+        for (size_t i = 0; i < n; ++i)
+            row(block[i]).fma(g, a[block[i]]);
+    }
+
+    /// <summary>
+    /// this += (a... 1)^T g
+    /// </summary>
+    void add_outer1(cvec_slice a, cvec_slice g) const
+    {
+        slice_rows(0, m_rows - 1).add_outer(a, g);
+        last_row().add(g);
+    }
+
+    /// <summary>
+    /// this += sum over samples s of as[s][offset...]^T gs[s], i.e. this[j] += as[s][offset + j] * gs[s], accumulated
+    /// in sample order so the result matches add_outer() called once per sample.
+    /// </summary>
+    void add_outer(span<cvec_slice> as, span<vec_slice> gs, size_t offset = 0) const
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (as.size() != gs.size()) std::terminate();
+        for (size_t s = 0; s < as.size(); ++s)
+            if (offset + m_rows > as[s].size() || gs[s].size() != m_cols) std::terminate();
+#endif
+        constexpr size_t W = 8;
+        const size_t k = as.size();
+        for (size_t j = 0; j < m_rows; ++j)
+        {
+            float* r = m_data + j * m_cols;
+            size_t c = 0;
+            // Keep a W-wide strip of this row in registers while all samples are folded in.
+            for (; c + W <= m_cols; c += W)
+            {
+                float acc[W];
+                for (size_t w = 0; w < W; ++w)
+                    acc[w] = r[c + w];
+                for (size_t s = 0; s < k; ++s)
+                {
+                    const float x = as[s].data()[offset + j];
+                    if (x == 0.0f) continue;
+                    const float* gr = gs[s].data() + c;
+                    for (size_t w = 0; w < W; ++w)
+                        acc[w] += x * gr[w];
+                }
+                for (size_t w = 0; w < W; ++w)
+                    r[c + w] = acc[w];
+            }
+            for (; c < m_cols; ++c)
+            {
+                float acc = r[c];
+                for (size_t s = 0; s < k; ++s)
+                {
+                    const float x = as[s].data()[offset + j];
+                    if (x != 0.0f) acc += x * gs[s].data()[c];
+                }
+                r[c] = acc;
+            }
+        }
+    }
+
+    /// <summary>
+    /// this += sum over samples s of (as[s]... 1)^T gs[s]
+    /// </summary>
+    void add_outer1(span<cvec_slice> as, span<vec_slice> gs) const
+    {
+        slice_rows(0, m_rows - 1).add_outer(as, gs);
+        for (size_t s = 0; s < gs.size(); ++s)
+            last_row().add(gs[s]);
+    }
+
+private:
+    void add_outer_rows4(const size_t (&rows)[4], const float* a, const float* g) const
+    {
+        float* __restrict r0 = m_data + rows[0] * m_cols;
+        float* __restrict r1 = m_data + rows[1] * m_cols;
+        float* __restrict r2 = m_data + rows[2] * m_cols;
+        float* __restrict r3 = m_data + rows[3] * m_cols;
+        const float a0 = a[rows[0]], a1 = a[rows[1]], a2 = a[rows[2]], a3 = a[rows[3]];
+        for (size_t c = 0; c < m_cols; ++c)
+        {
+            const float gc = g[c];
+            r0[c] += a0 * gc;
+            r1[c] += a1 * gc;
+            r2[c] += a2 * gc;
+            r3[c] += a3 * gc;
+        }
+    }
 };
 
 struct transposed_mat_slice : col_major_mat_slice_base
@@ -442,28 +782,102 @@ struct transposed_mat_slice : col_major_mat_slice_base
 
 transposed_mat_slice mat_slice::transpose() const { return {m_data, m_cols, m_rows}; }
 
+/// <summary>
+/// outs[s] = (vs[s]... 1) * M for every sample s. Each block of four rows of M is applied to the whole batch before
+/// moving on, so M is streamed once per batch instead of once per sample. Every output accumulates in the same order
+/// as assign_vm1_mult.
+/// </summary>
+inline void assign_vm1_mult_batch(span<vec_slice> outs, mat_slice m, span<cvec_slice> vs)
+{
+    const size_t n = m.rows() - 1;
+    for (size_t s = 0; s < outs.size(); ++s)
+    {
+#if !defined(NDEBUG) || defined(VEC_ENABLE_CHECKS)
+        if (vs[s].size() != n || outs[s].size() != m.cols()) std::terminate();
+#endif
+        outs[s].assign(m.last_row());
+    }
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float* r0 = m.row(j).data();
+        const float* r1 = m.row(j + 1).data();
+        const float* r2 = m.row(j + 2).data();
+        const float* r3 = m.row(j + 3).data();
+        for (size_t s = 0; s < outs.size(); ++s)
+        {
+            float* o = outs[s].data();
+            const float v0 = vs[s][j], v1 = vs[s][j + 1], v2 = vs[s][j + 2], v3 = vs[s][j + 3];
+            for (size_t i = 0; i < m.cols(); ++i)
+                o[i] = o[i] + r0[i] * v0 + r1[i] * v1 + r2[i] * v2 + r3[i] * v3;
+        }
+    }
+    for (; j < n; ++j)
+    {
+        for (size_t s = 0; s < outs.size(); ++s)
+            outs[s].fma(m.row(j), vs[s][j]);
+    }
+}
+
+/// <summary>
+/// Owning float buffer. Capacity is kept separately from size and is only released by shrink_to_fit(), so
+/// repeatedly resizing to similar lengths does not touch the heap. Payloads of up to inline_capacity floats are
+/// stored in the object itself; heap storage is 64-byte aligned.
+/// Moving a vec steals its heap buffer, but an inline payload is copied, so a vec_slice into a vec must not be
+/// used after the vec has been moved (e.g. by a std::vector regrowing).
+/// </summary>
 struct vec
 {
-    constexpr vec() = default;
+    static constexpr size_t inline_capacity = 16;
+    static constexpr size_t alignment = 64;
+
+    vec() = default;
     vec(const vec& o) { *this = o; }
+    vec(vec&& o) noexcept { *this = std::move(o); }
+    ~vec() { release(); }
 
     vec& operator=(const vec& o)
     {
+        if (this == &o) return *this;
         realloc_uninitialized(o.m_len);
-        for (size_t i = 0; i < m_len; ++i)
-            m_data[i] = o.m_data[i];
+        if (m_len) std::memcpy(m_data, o.m_data, m_len * sizeof(float));
+        return *this;
+    }
+    vec& operator=(vec&& o) noexcept
+    {
+        if (this == &o) return *this;
+        if (o.is_inline())
+        {
+            // Nothing to steal; copy into whatever storage we already have.
+            realloc_uninitialized(o.m_len);
+            if (m_len) std::memcpy(m_data, o.m_data, m_len * sizeof(float));
+        }
+        else
+        {
+            release();
+            m_data = o.m_data;
+            m_len = o.m_len;
+            m_cap = o.m_cap;
+            o.m_data = o.m_inline;
+            o.m_cap = inline_capacity;
+        }
+        o.m_len = 0;
         return *this;
     }
-    vec& operator=(vec&&) = default;
 
-    operator vec_slice() { return {m_data.get(), m_len}; }
+    operator vec_slice() { return {m_data, m_len}; }
 
     vec_slice slice() { return *this; }
-    vec_slice slice(size_t offset) { return {m_data.get() + offset, m_len - offset}; }
-    vec_slice slice(size_t offset, size_t len) { return {m_data.get() + offset, len}; }
+    vec_slice slice(size_t offset) { return {m_data + offset, m_len - offset}; }
+    vec_slice slice(size_t offset, size_t len) { return {m_data + offset, len}; }
+    operator cvec_slice() const { return {m_data, m_len}; }
+    cvec_slice slice() const { return *this; }
+    cvec_slice slice(size_t offset) const { return {m_data + offset, m_len - offset}; }
+    cvec_slice slice(size_t offset, size_t len) const { return {m_data + offset, len}; }
 
-    float* data() { return m_data.get(); }
+    float* data() { return m_data; }
     size_t size() const { return m_len; }
+    size_t capacity() const { return m_cap; }
 
     float& operator[](size_t i)
     {
@@ -473,11 +887,11 @@ struct vec
         return m_data[i];
     }
 
-    float* begin() { return m_data.get(); }
-    float* end() { return m_data.get() + m_len; }
+    float* begin() { return m_data; }
+    float* end() { return m_data + m_len; }
 
-    const float* begin() const { return m_data.get(); }
-    const float* end() const { return m_data.get() + m_len; }
+    const float* begin() const { return m_data; }
+    const float* end() const { return m_data + m_len; }
 
     void realloc(size_t n, float v)
     {
@@ -485,18 +899,48 @@ struct vec
         slice().assign(v);
     }
 
+    /// <summary>
+    /// Set the size to n. Contents are unspecified afterwards; storage is only replaced when n exceeds capacity().
+    /// </summary>
     void realloc_uninitialized(size_t n)
     {
-        if (n == 0)
-        {
-            m_data.reset();
-            m_len = 0;
-        }
-        else if (m_len != n)
+        if (n > m_cap)
         {
-            m_data = std::make_unique<float[]>(n);
-            m_len = n;
+            release();
+            m_data = static_cast<float*>(::operator new(n * sizeof(float), std::align_val_t(alignment)));
+            m_cap = n;
         }
+        m_len = n;
+    }
+
+    void reserve(size_t n)
+    {
+        if (n <= m_cap) return;
+        vec v;
+        v.realloc_uninitialized(n);
+        if (m_len) std::memcpy(v.m_data, m_data, m_len * sizeof(float));
+        v.m_len = m_len;
+        *this = std::move(v);
+    }
+
+    /// <summary>
+    /// Append x, doubling the capacity when full.
+    /// </summary>
+    void push_back(float x)
+    {
+        if (m_len == m_cap) reserve(2 * m_cap);
+        m_data[m_len++] = x;
+    }
+
+    void shrink_to_fit()
+    {
+        if (is_inline() || m_len == m_cap) return;
+        vec v;
+        v.realloc_uninitialized(m_len);
+        if (m_len) std::memcpy(v.m_data, m_data, m_len * sizeof(float));
+        // Drop our buffer first, or moving an inline v would just copy back into it.
+        release();
+        *this = std::move(v);
     }
 
     void alloc_assign(vec_slice v)
@@ -506,8 +950,18 @@ struct vec
     }
 
 private:
-    std::unique_ptr<float[]> m_data;
+    bool is_inline() const { return m_data == m_inline; }
+    void release()
+    {
+        if (!is_inline()) ::operator delete(m_data, std::align_val_t(alignment));
+        m_data = m_inline;
+        m_cap = inline_capacity;
+    }
+
+    float* m_data = m_inline;
     size_t m_len = 0;
+    size_t m_cap = inline_capacity;
+    float m_inline[inline_capacity];
 };
 
 #undef VEC_CHECK_BOUNDS
@@ -4,7 +4,7 @@
 #include "kv_range.h"
 #include "model.h"
 
-static unsigned int play_game(Game& g, IModel& m, std::vector<Turn>& turns)
+static unsigned int play_game(Game& g, const IModel& m, std::vector<Turn>& turns)
 {
     g.init();
     unsigned int turn_count = 0;
@@ -17,12 +17,11 @@ static unsigned int play_game(Game& g, IModel& m, std::vector<Turn>& turns)
         if (turn_count > turns.size()) turns.emplace_back();
 
         auto& turn = turns[turn_count - 1];
-        turn.input = g.encode();
+        g.encode(turn.input);
         turn.player2_turn = g.player2_turn;
         if (!turn.eval) turn.eval = m.make_eval();
         if (!turn.eval_full) turn.eval_full = m.make_eval();
-        m.calc(*turn.eval, turn.input, false);
-        m.calc(*turn.eval_full, turn.input, true);
+        m.calc_both(*turn.eval, *turn.eval_full, turn.input);
 
         if (exploregame)
         {
@@ -51,8 +50,7 @@ static void replay_game(IModel& m, std::vector<Turn>& turns)
 {
     for (auto&& turn : turns)
     {
-        m.calc(*turn.eval, turn.input, false);
-        m.calc(*turn.eval_full, turn.input, true);
+        m.calc_both(*turn.eval, *turn.eval_full, turn.input);
     }
 }
 
@@ -70,22 +68,46 @@ std::unique_ptr<IModel> Worker::clone_model()
     return m_model->clone();
 }
 
+std::unique_ptr<IModel> Worker::freeze_model()
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_model->freeze();
+}
+
 std::string Worker::model_name()
 {
     std::lock_guard<std::mutex> lk(m_mutex);
     return m_model ? m_model->name() : "none";
 }
 
-void Worker::replace_compete_baseline(std::shared_ptr<IModel> m)
+// Call with m_mutex held. Null stops competing until another baseline is posted.
+void Worker::post_compete_baseline(std::shared_ptr<IModel> m)
 {
-    std::lock_guard lk(m_mutex);
     m_compete_baseline = std::move(m);
-    if (!m_compete_th.joinable())
+    m_replace_compete_baseline = true;
+    if (m_compete_baseline && !m_compete_th.joinable())
     {
         m_compete_th = std::thread(&Worker::compete_baseline_work, this);
     }
 }
 
+void Worker::replace_compete_baseline(std::shared_ptr<IModel> m)
+{
+    std::lock_guard lk(m_mutex);
+    m_chosen_baseline = m;
+    post_compete_baseline(std::move(m));
+}
+
+void Worker::set_teacher(std::shared_ptr<IModel> teacher)
+{
+    // Both under one lock, so the training loop never takes a teacher without the matching baseline. The training
+    // loop and the compete thread both only calc on the teacher, so they share it.
+    std::lock_guard lk(m_mutex);
+    post_compete_baseline(teacher ? teacher : m_chosen_baseline);
+    m_teacher = std::move(teacher);
+    m_replace_teacher = true;
+}
+
 void Worker::serialize_model(struct RJWriter& w)
 {
     std::lock_guard<std::mutex> lk(m_mutex);
@@ -121,72 +143,152 @@ void Worker::work()
     int i_err = 0;
     size_t i_compete_model = 0;
     std::unique_ptr<IModel> m;
+    std::shared_ptr<IModel> teacher;
+    // Call with m_mutex held.
+    auto take_teacher = [&] {
+        if (!m_replace_teacher) return;
+        teacher = std::move(m_teacher);
+        m_replace_teacher = false;
+        m_distilling = teacher != nullptr;
+    };
     {
         std::lock_guard<std::mutex> lk(m_mutex);
         m = m_model->clone();
         m_replace_model = false;
         m_past_models.resize(compete_size);
+        take_teacher();
     }
     Game g;
     unsigned int turn_count = 0;
     std::vector<Turn> turns;
     turns.resize(40);
 
+    // Backprop batch for one pass over a game, kept across games. The grads are slices into Turn errors, so a
+    // batch must be run before turns can grow again.
+    std::vector<Encoded*> batch_inputs;
+    std::vector<IEval*> batch_evals;
+    std::vector<vec_slice> batch_grads;
+    auto add_to_batch = [&](Turn& t, IEval& e, vec& grad) {
+        batch_inputs.push_back(&t.input);
+        batch_evals.push_back(&e);
+        batch_grads.push_back(grad);
+    };
+    auto run_batch = [&](bool full) {
+        m->backprop_batch(batch_inputs, batch_evals, batch_grads, full);
+        batch_inputs.clear();
+        batch_evals.clear();
+        batch_grads.clear();
+    };
+
+    // The teacher's own games, while distilling.
+    std::vector<Turn> teacher_turns;
+    auto distill_game = [&] {
+        turn_count = play_game(g, *teacher, teacher_turns);
+        // The batches point into turns, so it must not grow while they are built.
+        if (turns.size() < turn_count) turns.resize(turn_count);
+
+        float error = 0.0f;
+        int agreed = 0;
+        // Full outputs are pulled toward the teacher's full outputs and the rest toward its non-full ones, which are
+        // what serving uses.
+        for (unsigned i = 0; i < turn_count; i++)
+        {
+            auto& t = teacher_turns[i];
+            auto& turn = turns[i];
+            turn.input = t.input;
+            turn.player2_turn = t.player2_turn;
+            turn.chosen_action = t.chosen_action;
+            if (!turn.eval) turn.eval = m->make_eval();
+            if (!turn.eval_full) turn.eval_full = m->make_eval();
+            m->calc_both(*turn.eval, *turn.eval_full, turn.input);
+            agreed += turn.eval->best_action() == t.eval->best_action();
+
+            turn.error_full.realloc_uninitialized(turn.input.avail_actions());
+            turn.error_full.slice().assign(turn.eval_full->out() - t.eval_full->out());
+            add_to_batch(turn, *turn.eval_full, turn.error_full);
+            error += turn.error_full.slice().dot(turn.error_full);
+        }
+        run_batch(true);
+
+        for (unsigned i = 0; i < turn_count; i++)
+        {
+            auto& turn = turns[i];
+            turn.error.realloc_uninitialized(turn.input.avail_actions());
+            turn.error.slice().assign(turn.eval->out() - teacher_turns[i].eval->out());
+            add_to_batch(turn, *turn.eval, turn.error);
+            error += turn.error.slice().dot(turn.error);
+        }
+        run_batch(false);
+
+        m_agreement[i_err] = agreed * 1.0f / turn_count;
+        return error;
+    };
+
     float total_error = 0.0f;
 
     m->backprop_init();
 
     while (!m_worker_exit)
     {
-        turn_count = play_game(g, *m, turns);
+        if (teacher)
+        {
+            total_error = distill_game();
+        }
+        else
+        {
+            turn_count = play_game(g, *m, turns);
 
-        // First, fill in the error values
-        auto& turn = turns[turn_count - 1];
-        auto last_player_won = g.cur_result() == (turn.player2_turn ? Game::Result::p2_win : Game::Result::p1_win);
+            // First, fill in the error values
+            auto& turn = turns[turn_count - 1];
+            auto last_player_won = g.cur_result() == (turn.player2_turn ? Game::Result::p2_win : Game::Result::p1_win);
 
-        total_error = 0.0;
+            total_error = 0.0;
 
-        // full model
-        auto predicted = turn.eval_full->pct_for_action(turn.chosen_action);
-        auto error = predicted - static_cast<float>(last_player_won);
-        turn.error_full.realloc(turn.input.avail_actions(), 0.0f);
-        turn.error_full[turn.chosen_action] = error * turn.input.avail_actions();
+            // full model
+            auto predicted = turn.eval_full->pct_for_action(turn.chosen_action);
+            auto error = predicted - static_cast<float>(last_player_won);
+            turn.error_full.realloc(turn.input.avail_actions(), 0.0f);
+            turn.error_full[turn.chosen_action] = error * turn.input.avail_actions();
 
-        m->backprop(*turn.eval_full, turn.input, turn.error_full, true);
-        total_error += error * error;
+            add_to_batch(turn, *turn.eval_full, turn.error_full);
+            total_error += error * error;
 
-        auto next_turn_expected = static_cast<float>(last_player_won);
-        for (int i = (int)turn_count - 2; i >= 0; --i)
-        {
-            auto& turn = turns[i];
-            auto& next_turn = turns[i + 1];
-            auto predicted = turn.eval_full->pct_for_action(turn.chosen_action);
-            auto expected = next_turn.eval_full->clamped_best_pct(next_turn.chosen_action, next_turn_expected);
-            if (next_turn.player2_turn != turn.player2_turn)
+            auto next_turn_expected = static_cast<float>(last_player_won);
+            for (int i = (int)turn_count - 2; i >= 0; --i)
             {
-                expected = 1.0f - expected;
+                auto& turn = turns[i];
+                auto& next_turn = turns[i + 1];
+                auto predicted = turn.eval_full->pct_for_action(turn.chosen_action);
+                auto expected = next_turn.eval_full->clamped_best_pct(next_turn.chosen_action, next_turn_expected);
+                if (next_turn.player2_turn != turn.player2_turn)
+                {
+                    expected = 1.0f - expected;
+                }
+                auto error = predicted - expected;
+                turn.error_full.realloc(turn.input.avail_actions(), 0.0);
+                turn.error_full[turn.chosen_action] = error * turn.input.avail_actions();
+                add_to_batch(turn, *turn.eval_full, turn.error_full);
+                total_error += error * error;
+                next_turn_expected = expected;
             }
-            auto error = predicted - expected;
-            turn.error_full.realloc(turn.input.avail_actions(), 0.0);
-            turn.error_full[turn.chosen_action] = error * turn.input.avail_actions();
-            m->backprop(*turn.eval_full, turn.input, turn.error_full, true);
-            total_error += error * error;
-            next_turn_expected = expected;
-        }
+            // Backprop leaves the evals' outputs alone, so the targets above can all be computed first.
+            run_batch(true);
 
-        for (unsigned i = 0; i < turn_count; i++)
-        {
-            auto&& turn = turns[i];
-            turn.error.realloc_uninitialized(turn.input.avail_actions());
-            turn.error.slice().assign_sub(turn.eval->out(), turn.eval_full->out());
-            m->backprop(*turn.eval, turn.input, turn.error, false);
-            total_error += turn.error.slice().dot(turn.error);
+            for (unsigned i = 0; i < turn_count; i++)
+            {
+                auto&& turn = turns[i];
+                turn.error.realloc_uninitialized(turn.input.avail_actions());
+                turn.error.slice().assign(turn.eval->out() - turn.eval_full->out());
+                add_to_batch(turn, *turn.eval, turn.error);
+                total_error += turn.error.slice().dot(turn.error);
+            }
+            run_batch(false);
         }
 
         //// now learn
 
         m_err[i_err] = total_error;
-        i_err = (i_err + 1ULL) % std::size(m_err);
+        i_err = (i_err + 1ULL) % err_size;
 
         learn_tick++;
         if (learn_tick >= 10000) learn_tick = 0;
@@ -206,6 +308,7 @@ void Worker::work()
                 if (m_replace_model)
                 {
                     m = m_model->clone();
+                    m->backprop_init();
                     m_replace_model = false;
                 }
                 else
@@ -214,7 +317,8 @@ void Worker::work()
                     delete m_model;
                     m_model = m->clone().release();
                 }
-                m_past_models[i_compete_model] = m->clone();
+                take_teacher();
+                m_past_models[i_compete_model] = m->freeze();
                 m_past_models_cv.notify_one();
             }
             i_compete_model++;
@@ -234,14 +338,18 @@ void Worker::compete_baseline_work()
         m_past_models_cv.wait(lk);
         if (m_worker_exit) return;
 
-        intptr_t i = 0;
-        if (m_compete_baseline)
+        size_t i = 0;
+        if (m_replace_compete_baseline)
         {
             compete_baseline = std::move(m_compete_baseline);
+            m_replace_compete_baseline = false;
             auto m = m_past_models[0];
             lk.unlock();
             past_models_copy.assign(compete_size, nullptr);
             past_models_copy[0] = std::move(m);
+            if (!compete_baseline)
+                for (auto& r : m_compete_results)
+                    r = 0;
         }
         else
         {
@@ -249,10 +357,10 @@ void Worker::compete_baseline_work()
                 m_past_models.begin(), m_past_models.end(), past_models_copy.begin(), past_models_copy.end());
             if (it2 != past_models_copy.end()) *it2 = *it1;
             lk.unlock();
-            i = it2 - past_models_copy.begin();
+            i = static_cast<size_t>(it2 - past_models_copy.begin());
         }
 
-        if (i < past_models_copy.size() && past_models_copy[i])
+        if (compete_baseline && i < past_models_copy.size() && past_models_copy[i])
         {
             auto wins = 0;
             auto losses = 0;
@@ -15,13 +15,20 @@ struct IModel;
 struct Worker
 {
     std::atomic<int> m_trials = 0;
-    std::atomic<float> m_err[200] = {};
+    // Per-game history length of m_err and m_agreement, which share a write index.
+    static constexpr size_t err_size = 200;
+    std::atomic<float> m_err[err_size] = {};
     std::atomic<float> m_learn_rate = 0.004;
     static constexpr size_t compete_size = 200;
     std::atomic<float> m_compete_results[compete_size] = {};
+    // Per game while distilling: the fraction of positions where the model picks the teacher's action.
+    std::atomic<float> m_agreement[err_size] = {};
+    std::atomic<bool> m_distilling = false;
 
     void replace_model(std::unique_ptr<struct IModel> model);
     std::unique_ptr<struct IModel> clone_model();
+    // Inference-only snapshot of the current model; see IModel::freeze().
+    std::unique_ptr<struct IModel> freeze_model();
     void serialize_model(struct RJWriter& w);
     std::string model_name();
 
@@ -29,10 +36,16 @@ struct Worker
     void join();
 
     void replace_compete_baseline(std::shared_ptr<IModel> m);
+    // Distillation: rather than learning from its own games, the model learns to reproduce the teacher's outputs on
+    // positions from the teacher's self-play, and competes against the teacher. Null goes back to self-play and to
+    // the last baseline given to replace_compete_baseline, if any. The worker only evaluates the teacher, so it may be
+    // shared; it must not be trained meanwhile.
+    void set_teacher(std::shared_ptr<IModel> teacher);
 
 private:
     void work();
     void compete_baseline_work();
+    void post_compete_baseline(std::shared_ptr<IModel> m);
 
     std::thread m_th, m_compete_th;
     std::atomic<bool> m_worker_exit = false;
@@ -43,5 +56,10 @@ private:
     std::mutex m_mutex;
     struct IModel* m_model = nullptr;
     bool m_replace_model = false;
+    std::shared_ptr<IModel> m_teacher;
+    bool m_replace_teacher = false;
     std::shared_ptr<IModel> m_compete_baseline;
+    bool m_replace_compete_baseline = false;
+    // The baseline last chosen through replace_compete_baseline, restored when a teacher is cleared.
+    std::shared_ptr<IModel> m_chosen_baseline;
 };
@@ -0,0 +1,128 @@
+// Several threads evaluate one shared model at once through calc, calc_both and calc_batch, and every result must
+// match a serial pass over the same positions. Run it under ThreadSanitizer to check the const inference path.
+#include "game.h"
+#include "model.h"
+#include "modeldims.h"
+#include "vec.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static constexpr int thread_count = 8;
+static constexpr size_t batch_size = 8;
+
+static std::vector<Encoded> positions(size_t n)
+{
+    std::vector<Encoded> v;
+    Game g;
+    g.init();
+    while (v.size() < n)
+    {
+        if (g.cur_result() != Game::Result::playing) g.init();
+        v.push_back(g.encode());
+        g.advance(rand() % v.back().avail_actions());
+    }
+    return v;
+}
+
+static bool same(vec_slice x, const vec& y)
+{
+    return x.size() == y.size() && std::memcmp(x.data(), y.begin(), x.size() * sizeof(float)) == 0;
+}
+
+// A trainable model, a frozen cascade model and a frozen model with sparse layers.
+static std::shared_ptr<const IModel> make_variant(int variant)
+{
+    auto d = default_model_dims();
+    if (variant == 1)
+    {
+        d.children["l"].dims = {48, 30};
+        d.children["l"].type = "ReLUCascade";
+    }
+    auto m = make_model(d, "stress");
+    if (variant == 0) return m;
+    if (variant == 2) m->normalize(0.02f);
+    return m->freeze();
+}
+
+static int run_variant(int variant, const std::vector<Encoded>& pos)
+{
+    auto m = make_variant(variant);
+
+    std::vector<vec> ref(pos.size()), ref_full(pos.size());
+    {
+        auto e = m->make_eval();
+        for (size_t i = 0; i < pos.size(); ++i)
+        {
+            m->calc(*e, pos[i], false);
+            ref[i].realloc_uninitialized(e->out().size());
+            ref[i].slice().assign(e->out());
+            m->calc(*e, pos[i], true);
+            ref_full[i].realloc_uninitialized(e->out().size());
+            ref_full[i].slice().assign(e->out());
+        }
+    }
+
+    std::atomic<int> bad = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t] {
+            auto a = m->make_eval(), b = m->make_eval();
+            std::vector<std::unique_ptr<IEval>> batch;
+            std::vector<IEval*> batch_ptrs;
+            for (size_t i = 0; i < batch_size; ++i)
+            {
+                batch.push_back(m->make_eval());
+                batch_ptrs.push_back(batch.back().get());
+            }
+            // Neighbouring threads overlap on most positions, and each pass shifts which entry point a position uses.
+            for (size_t pass = 0; pass < 3; ++pass)
+            {
+                for (size_t i = t; i < pos.size(); i += 3)
+                {
+                    switch ((i + pass) % 3)
+                    {
+                        case 0:
+                            m->calc(*a, pos[i], false);
+                            if (!same(a->out(), ref[i])) ++bad;
+                            break;
+                        case 1:
+                            m->calc_both(*a, *b, pos[i]);
+                            if (!same(a->out(), ref[i]) || !same(b->out(), ref_full[i])) ++bad;
+                            break;
+                        default:
+                        {
+                            const size_t k = std::min(batch_size, pos.size() - i);
+                            m->calc_batch({pos.data() + i, k}, {batch_ptrs.data(), k}, true);
+                            for (size_t j = 0; j < k; ++j)
+                                if (!same(batch_ptrs[j]->out(), ref_full[i + j])) ++bad;
+                            break;
+                        }
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    std::printf("variant %d: %d mismatches\n", variant, bad.load());
+    return bad;
+}
+
+int main()
+{
+    srand(3);
+    const auto pos = positions(200);
+    int failures = 0;
+    for (int variant = 0; variant < 3; ++variant)
+        failures += run_variant(variant, pos);
+    std::printf(failures ? "FAIL\n" : "ok\n");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}